@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <chrono>
+#include "luna.h"
+#include "luna_alloc.h"
+
+// luna分配器与lua默认分配器(realloc)的对比,负载与example.cpp相同: 导出对象,成员函数闭包,字符串和小表
+
+class bench_class final {
+public:
+    int m_id = 0;
+    int func_a(int a) { return a + m_id; }
+    DECLARE_LUA_CLASS(bench_class);
+};
+
+LUA_EXPORT_CLASS_BEGIN(bench_class)
+LUA_EXPORT_METHOD(func_a)
+LUA_EXPORT_PROPERTY(m_id)
+LUA_EXPORT_CLASS_END()
+
+bench_class* NewBenchClass() {
+    return new bench_class();
+}
+
+static const char* s_script =
+    "local sum = 0\n"
+    "for i = 1, 200000 do\n"
+    "    local obj = NewBenchClass()\n"
+    "    obj.id = i\n"
+    "    sum = sum + obj.func_a(1)\n"
+    "    local t = { name = 'obj' .. i, pos = { x = i, y = i } }\n"
+    "    sum = sum + #t.name\n"
+    "end\n"
+    "return sum\n";
+
+static double run(lua_State* L) {
+    luaL_openlibs(L);
+    lua_register_function(L, "NewBenchClass", NewBenchClass);
+    auto start = std::chrono::steady_clock::now();
+    if (luaL_dostring(L, s_script)) {
+        printf("%s\n", lua_tostring(L, -1));
+    }
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    for (int round = 0; round < 3; round++) {
+        lua_State* L = luaL_newstate();
+        double ms_default = run(L);
+        lua_close(L);
+
+        L = luna_newstate();
+        double ms_luna = run(L);
+        const luna_alloc_stats* stats = luna_get_alloc_stats(L);
+        printf("default: %.1fms, luna: %.1fms, peak: %zu bytes, large: %llu\n",
+            ms_default, ms_luna, stats->peak, (unsigned long long)stats->large_count);
+        luna_close(L);
+    }
+    return 0;
+}
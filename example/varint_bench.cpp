@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "var_int.h"
+
+// 批量varint编解码与逐个调用encode_u64/decode_u64的对比,并校验两者的结果完全一致
+
+static const size_t value_count = 1 << 20;
+
+static double ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// 每个值的编码长度在[1, max_len]之间
+static void make_values(std::vector<uint64_t>& values, int max_len, uint32_t seed) {
+    std::mt19937_64 rng(seed);
+    for (auto& v : values) {
+        int len = 1 + (int)(rng() % max_len);
+        int bits = len * 7 > 64 ? 64 : len * 7;
+        v = bits == 64 ? rng() : rng() & ((1ull << bits) - 1);
+    }
+}
+
+static bool check_boundary() {
+    std::vector<uint64_t> values;
+    for (int bits = 0; bits <= 64; bits++) {
+        uint64_t v = bits == 64 ? ~0ull : (1ull << bits);
+        values.push_back(v - 1);
+        values.push_back(v);
+        values.push_back(v + 1);
+    }
+    for (size_t offset = 0; offset < values.size(); offset++) {
+        size_t count = values.size() - offset;
+        std::vector<unsigned char> scalar(count * MAX_VARINT_SIZE), batch(count * MAX_VARINT_SIZE);
+        size_t scalar_len = 0;
+        for (size_t i = 0; i < count; i++) {
+            scalar_len += encode_u64(&scalar[scalar_len], scalar.size() - scalar_len, values[offset + i]);
+        }
+        size_t batch_len = encode_u64_batch(batch.data(), batch.size(), &values[offset], count);
+        if (batch_len != scalar_len || memcmp(scalar.data(), batch.data(), scalar_len) != 0)
+            return false;
+        // 数据截断时必须失败
+        std::vector<uint64_t> decoded(count);
+        if (decode_u64_batch(decoded.data(), count, scalar.data(), scalar_len - 1) != 0)
+            return false;
+        if (decode_u64_batch(decoded.data(), count, scalar.data(), scalar_len) != scalar_len)
+            return false;
+        if (memcmp(decoded.data(), &values[offset], count * sizeof(uint64_t)) != 0)
+            return false;
+    }
+    // 超过10字节的编码是非法的
+    unsigned char bad[32];
+    memset(bad, 0x80, sizeof(bad));
+    uint64_t v = 0;
+    return decode_u64_batch(&v, 1, bad, sizeof(bad)) == 0;
+}
+
+static void bench(int max_len) {
+    std::vector<uint64_t> values(value_count), decoded(value_count);
+    std::vector<unsigned char> buffer(value_count * MAX_VARINT_SIZE), batch(value_count * MAX_VARINT_SIZE);
+    make_values(values, max_len, (uint32_t)max_len);
+
+    auto start = std::chrono::steady_clock::now();
+    size_t len = 0;
+    for (auto v : values) {
+        len += encode_u64(&buffer[len], buffer.size() - len, v);
+    }
+    double encode_ms = ms_since(start);
+
+    start = std::chrono::steady_clock::now();
+    size_t batch_len = encode_u64_batch(batch.data(), batch.size(), values.data(), values.size());
+    double encode_batch_ms = ms_since(start);
+
+    start = std::chrono::steady_clock::now();
+    size_t pos = 0;
+    for (auto& v : decoded) {
+        pos += decode_u64(&v, &buffer[pos], len - pos);
+    }
+    double decode_ms = ms_since(start);
+    bool ok = pos == len && decoded == values;
+
+    decoded.assign(value_count, 0);
+    start = std::chrono::steady_clock::now();
+    size_t batch_pos = decode_u64_batch(decoded.data(), decoded.size(), buffer.data(), len);
+    double decode_batch_ms = ms_since(start);
+    ok = ok && batch_len == len && memcmp(buffer.data(), batch.data(), len) == 0 && batch_pos == len && decoded == values;
+
+    printf("max_len %2d: encode %.2fms, batch %.2fms; decode %.2fms, batch %.2fms; %s\n",
+        max_len, encode_ms, encode_batch_ms, decode_ms, decode_batch_ms, ok ? "ok" : "MISMATCH");
+}
+
+int main() {
+    printf("boundary: %s\n", check_boundary() ? "ok" : "MISMATCH");
+    for (int max_len : {1, 2, 3, 5, 10}) {
+        bench(max_len);
+    }
+    return 0;
+}
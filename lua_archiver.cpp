@@ -6,6 +6,11 @@
 #include <stdint.h>
 #include <string.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #ifdef _MSC_VER
 #include <intrin.h>
 #include <winsock2.h>
@@ -13,11 +18,17 @@
 #include "lua.hpp"
 #include "lz4.h"
 #include "lua_archiver.h"
+#include "luna_trace.h"
 #include "var_int.h"
 
 #ifdef __linux
 inline uint64_t htonll(uint64_t h64bits) { return htobe64(h64bits); }
 inline uint64_t ntohll(uint64_t n64bits) { return be64toh(n64bits); }
+inline uint64_t htolell(uint64_t h64bits) { return htole64(h64bits); }
+inline uint64_t letohll(uint64_t le64bits) { return le64toh(le64bits); }
+#else
+inline uint64_t htolell(uint64_t h64bits) { return h64bits; }
+inline uint64_t letohll(uint64_t le64bits) { return le64bits; }
 #endif
 
 enum class ar_type : unsigned char {
@@ -34,8 +45,165 @@ enum class ar_type : unsigned char {
 };
 
 static const int small_int_max = UCHAR_MAX - (int)ar_type::count;
-static const int max_share_string = UCHAR_MAX;
 static const int max_table_depth = 16;
+// table_head之后的这个字节在旧格式中是log2(哈希部分大小),不会超过32,所以用0x80表示新格式
+static const unsigned char table_segment = 0x80;
+// 数组部分是同一类型时的紧凑格式: 整数为差分后zigzag的varint,浮点数为小端的8字节,布尔值为位图
+static const unsigned char table_packed_int = 0x81;
+static const unsigned char table_packed_double = 0x82;
+static const unsigned char table_packed_bool = 0x83;
+// 引用本次数据中之前出现过的table,其后是varint编码的序号(仅在ar_flag_table_ref时)
+static const unsigned char table_ref = 0xC0;
+// 数组太短时紧凑格式省不了多少,不值得多一遍类型检查
+static const lua_Integer packed_array_min = 8;
+// 紧凑数组按块处理,块内的循环都是定长数组上的简单运算,编译器可以向量化; 必须是8的倍数,位图才能按字节对齐
+static const int pack_chunk = 256;
+
+static unsigned char packed_kind(lua_State* L, int idx) {
+    int type = lua_type(L, idx);
+    if (type == LUA_TBOOLEAN)
+        return table_packed_bool;
+    if (type == LUA_TNUMBER)
+        return lua_isinteger(L, idx) ? table_packed_int : table_packed_double;
+    return table_segment;
+}
+
+static void delta_zigzag(const uint64_t* values, uint64_t* out, int count, uint64_t prev) {
+    out[0] = values[0] - prev;
+    for (int i = 1; i < count; i++) {
+        out[i] = values[i] - values[i - 1];
+    }
+    for (int i = 0; i < count; i++) {
+        out[i] = (out[i] << 1) ^ (uint64_t)((int64_t)out[i] >> 63);
+    }
+}
+
+// zigzag还原可以向量化,前缀和只能串行
+static void zigzag_prefix_sum(uint64_t* values, int count, uint64_t prev) {
+    for (int i = 0; i < count; i++) {
+        values[i] = (values[i] >> 1) ^ (0 - (values[i] & 1));
+    }
+    for (int i = 0; i < count; i++) {
+        prev += values[i];
+        values[i] = prev;
+    }
+}
+
+static void pack_bits(const uint64_t* values, int count, unsigned char* out) {
+    for (int i = 0; i < count; i += 8) {
+        unsigned char bits = 0;
+        for (int j = 0; j < 8 && i + j < count; j++) {
+            bits |= (unsigned char)(values[i + j] << j);
+        }
+        out[i / 8] = bits;
+    }
+}
+
+static void unpack_bits(const unsigned char* in, int count, uint64_t* values) {
+    for (int i = 0; i < count; i++) {
+        values[i] = (in[i / 8] >> (i % 8)) & 1;
+    }
+}
+
+// 数据头部: 'x'原始数据,'z'LZ4压缩; 使用字典,会话,LZ4流模式或table引用时为'X','Z',其后是一个字节的ar_flag,以及(依次,按需):
+// varint编码的字典id, 会话表大小(仅在ar_flag_reset时), 原始数据长度(仅在ar_flag_lz_stream或ar_flag_lz_block时),
+// 块大小,块数及各块压缩后的长度(仅在ar_flag_lz_block时); 头部不压缩
+static bool is_lz4(unsigned char head) { return head == 'z' || head == 'Z'; }
+
+static const unsigned char ar_flag_dict = 1;
+static const unsigned char ar_flag_session = 2;
+static const unsigned char ar_flag_reset = 4;
+static const unsigned char ar_flag_lz_stream = 8;
+static const unsigned char ar_flag_lz_reset = 16;
+static const unsigned char ar_flag_lz_block = 32;
+static const unsigned char ar_flag_table_ref = 64;
+static const size_t max_header_size = sizeof(unsigned char) * 2 + MAX_VARINT_SIZE * 3;
+static const uint64_t max_session_size = 1 << 20;
+// 连续这么多次save/load的数据都不超过初始大小,才把扩大过的缓冲区恢复为初始大小
+static const int shrink_after = 16;
+static const int lz_window = 64 * 1024;
+static const int lz_probe_size = 4096;
+static const int lz_probe_count = 3;
+
+// 分块压缩(解压)用的线程池,调用线程也参与工作,各线程从同一个计数器中领取块序号
+class lz_worker_pool {
+public:
+    lz_worker_pool(int threads) {
+        for (int i = 1; i < threads; i++) {
+            m_threads.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    ~lz_worker_pool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    void run(int count, const std::function<void(int, int)>& job) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = &job;
+            m_count = count;
+            m_next = 0;
+            m_busy = (int)m_threads.size();
+            m_round++;
+        }
+        m_cv.notify_all();
+        consume(0);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done_cv.wait(lock, [this]() { return m_busy == 0; });
+        m_job = nullptr;
+    }
+
+private:
+    void work(int worker) {
+        uint64_t round = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this, round]() { return m_stop || m_round != round; });
+                if (m_stop)
+                    return;
+                round = m_round;
+            }
+            consume(worker);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_busy--;
+            }
+            m_done_cv.notify_one();
+        }
+    }
+
+    void consume(int worker) {
+        int index = 0;
+        while ((index = m_next.fetch_add(1)) < m_count) {
+            (*m_job)(worker, index);
+        }
+    }
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_done_cv;
+    const std::function<void(int, int)>* m_job = nullptr;
+    int m_count = 0;
+    std::atomic<int> m_next{ 0 };
+    int m_busy = 0;
+    uint64_t m_round = 0;
+    bool m_stop = false;
+};
+
+static uint64_t steady_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 static int normal_index(lua_State* L, int idx) {
     int top = lua_gettop(L);
@@ -75,6 +243,15 @@ lua_archiver::lua_archiver(size_t ar_size, size_t lz_size) {
 
 lua_archiver::~lua_archiver() {
     free_buffer();
+    set_lz_stream(false);
+    delete m_lz_state;
+    m_lz_state = nullptr;
+    delete m_lz_pool;
+    m_lz_pool = nullptr;
+    if (m_lz_stream_decode) {
+        LZ4_freeStreamDecode(m_lz_stream_decode);
+        m_lz_stream_decode = nullptr;
+    }
 }
 
 void lua_archiver::set_buffer_size(size_t size) {
@@ -84,55 +261,572 @@ void lua_archiver::set_buffer_size(size_t size) {
 }
 
 void* lua_archiver::save(size_t* data_len, lua_State* L, int first, int last) {
+    if (!luna_trace_enabled())
+        return save_data(data_len, L, first, last);
+
+    uint64_t start = luna_trace_now();
+    void* data = save_data(data_len, L, first, last);
+    luna_trace_complete("archiver", "save", start, "bytes", data ? (int64_t)*data_len : 0, "lz4", data != nullptr && data == m_lz_buffer);
+    return data;
+}
+
+void* lua_archiver::save_data(size_t* data_len, lua_State* L, int first, int last) {
+    shrink_buffer(true);
+    if (!alloc_buffer() || !save_values(m_ar_buffer, m_ar_capacity, L, first, last))
+        return nullptr;
+
+    *data_len = (size_t)(m_pos - m_begin);
+    if (need_compress(*data_len)) {
+        size_t lz_len = compress();
+        if (lz_len > 0) {
+            *data_len = lz_len;
+            return m_lz_buffer;
+        }
+    }
+    return m_ar_buffer;
+}
+
+size_t lua_archiver::save(void* buffer, size_t buffer_size, lua_State* L, int first, int last) {
+    if (!luna_trace_enabled())
+        return save_data(buffer, buffer_size, L, first, last);
+
+    uint64_t start = luna_trace_now();
+    size_t len = save_data(buffer, buffer_size, L, first, last);
+    luna_trace_complete("archiver", "save", start, "bytes", (int64_t)len, "lz4", len > 0 && is_lz4(*(unsigned char*)buffer));
+    return len;
+}
+
+size_t lua_archiver::save_data(void* buffer, size_t buffer_size, lua_State* L, int first, int last) {
+    shrink_buffer(true);
+    if (buffer_size == 0 || !alloc_buffer() || !save_values((unsigned char*)buffer, buffer_size, L, first, last))
+        return 0;
+
+    size_t len = (size_t)(m_pos - m_begin);
+    if (need_compress(len)) {
+        size_t lz_len = compress();
+        if (lz_len > 0 && lz_len <= buffer_size) {
+            memcpy(buffer, m_lz_buffer, lz_len);
+            len = lz_len;
+        } else if (m_lz_stream) {
+            // 压缩历史中已经有了这条(没有发出的)消息
+            reset_lz_stream();
+        }
+    }
+    return len;
+}
+
+size_t lua_archiver::save(std::string* sink, lua_State* L, int first, int last) {
+    if (!luna_trace_enabled())
+        return save_data(sink, L, first, last);
+
+    uint64_t start = luna_trace_now();
+    size_t base = sink->size();
+    size_t len = save_data(sink, L, first, last);
+    luna_trace_complete("archiver", "save", start, "bytes", (int64_t)len, "lz4", len > 0 && is_lz4((*sink)[base]));
+    return len;
+}
+
+size_t lua_archiver::save_data(std::string* sink, lua_State* L, int first, int last) {
+    shrink_buffer(true);
+    if (!alloc_buffer())
+        return 0;
+
+    // 先把sink扩到现有容量(不超过缓冲区上限),不够时在grow_sink中按倍数扩大,最后再截掉多余的部分
+    size_t base = sink->size();
+    size_t limit = std::max(m_ar_buffer_size, m_max_buffer_size);
+    sink->resize(std::max(std::min(sink->capacity(), base + limit), base + 1 + MAX_VARINT_SIZE));
+    m_sink = sink;
+    m_sink_base = base;
+    bool ok = save_values((unsigned char*)&(*sink)[base], sink->size() - base, L, first, last);
+    m_sink = nullptr;
+    if (!ok) {
+        sink->resize(base);
+        return 0;
+    }
+
+    size_t len = (size_t)(m_pos - m_begin);
+    if (need_compress(len)) {
+        size_t lz_len = compress();
+        if (lz_len > 0 && (lz_len <= len || m_lz_stream)) {
+            sink->resize(std::max(sink->size(), base + lz_len));
+            memcpy(&(*sink)[base], m_lz_buffer, lz_len);
+            len = lz_len;
+        }
+    }
+    sink->resize(base + len);
+    return len;
+}
+
+size_t lua_archiver::save(std::vector<iovec>* iov, lua_State* L, int first, int last) {
+    if (!luna_trace_enabled())
+        return save_data(iov, L, first, last);
+
+    uint64_t start = luna_trace_now();
+    size_t len = save_data(iov, L, first, last);
+    luna_trace_complete("archiver", "save", start, "bytes", (int64_t)len, "lz4", len > 0 && iov->front().iov_base == m_lz_buffer);
+    return len;
+}
+
+// 大字符串只在m_ar_buffer中写入类型及长度,数据本身作为单独的iovec引用lua字符串
+// 有引用时不压缩(压缩需要连续的数据),否则与普通save相同,结果为单个iovec
+size_t lua_archiver::save_data(std::vector<iovec>* iov, lua_State* L, int first, int last) {
+    iov->clear();
+    shrink_buffer(true);
+    if (!alloc_buffer())
+        return 0;
+
+    m_iov_mode = true;
+    m_iov_refs.clear();
+    bool ok = save_values(m_ar_buffer, m_ar_capacity, L, first, last);
+    m_iov_mode = false;
+    if (!ok)
+        return 0;
+
+    size_t ar_len = (size_t)(m_pos - m_begin);
+    if (m_iov_refs.empty()) {
+        void* data = m_ar_buffer;
+        if (need_compress(ar_len)) {
+            size_t lz_len = compress();
+            if (lz_len > 0) {
+                data = m_lz_buffer;
+                ar_len = lz_len;
+            }
+        }
+        iov->push_back({ data, ar_len });
+        return ar_len;
+    }
+
+    size_t total = ar_len;
+    size_t offset = 0;
+    iov->reserve(m_iov_refs.size() * 2 + 1);
+    for (auto& ref : m_iov_refs) {
+        if (ref.offset > offset) {
+            iov->push_back({ m_ar_buffer + offset, ref.offset - offset });
+        }
+        iov->push_back({ (void*)ref.str, ref.len });
+        offset = ref.offset;
+        total += ref.len;
+    }
+    if (ar_len > offset) {
+        iov->push_back({ m_ar_buffer + offset, ar_len - offset });
+    }
+    return total;
+}
+
+bool lua_archiver::save_values(unsigned char* buffer, size_t buffer_size, lua_State* L, int first, int last) {
     first = normal_index(L, first);
     last = normal_index(L, last);
-    if (last < first || !alloc_buffer())
-        return nullptr;
+    if (last < first)
+        return false;
 
-    *m_ar_buffer = 'x';
-    m_begin = m_ar_buffer;
-    m_end = m_ar_buffer + m_ar_buffer_size;
-    m_pos = m_begin + 1;
+    int top = lua_gettop(L);
+    m_begin = buffer;
+    m_end = buffer + buffer_size;
+    m_pos = m_begin;
     m_table_depth = 0;
-    m_shared_string.clear();
-    m_shared_strlen.clear();
+    m_table_refs.clear();
+    reset_shared_str();
 
-    for (int i = first; i <= last; i++) {
-        if (!save_value(L, i))
-            return nullptr;
+    bool ok = save_header();
+    for (int i = first; ok && i <= last; i++) {
+        ok = save_value(L, i);
     }
 
-    *data_len = (size_t)(m_pos - m_begin);
-    if (*data_len >= m_lz_threshold) {
-        *m_lz_buffer = 'z';
-        int raw_len = ((int)*data_len) - 1;        
-        int out_len = LZ4_compress_default((const char*)m_begin + 1, (char*)m_lz_buffer + 1, raw_len, (int)m_lz_buffer_size - 1);
-        if (out_len > 0) {
-            *data_len = 1 + out_len;
-            return m_lz_buffer;
+    // 失败多半是空间不足,按大数据计
+    note_data_size(ok ? (size_t)(m_pos - m_begin) : SIZE_MAX);
+    if (!ok) {
+        // 空间不足时可能停在table遍历的中途,栈上还留着key/value
+        lua_settop(L, top);
+    }
+    if (!ok && !m_session_slots.empty()) {
+        // 会话表中可能已经记录了没有发出去的字符串
+        reset_session();
+    }
+    return ok;
+}
+
+bool lua_archiver::save_header() {
+    unsigned char flags = m_table_ref ? ar_flag_table_ref : 0;
+    m_dict_base = (int)m_dict_strings.size();
+    m_message_base = m_dict_base + (int)m_session_slots.size();
+    if (!m_dict_strings.empty()) {
+        flags |= ar_flag_dict;
+    }
+    if (!m_session_slots.empty()) {
+        flags |= ar_flag_session;
+        if (m_session_reset) {
+            flags |= ar_flag_reset;
         }
+        m_session_gen++;
     }
-    return m_ar_buffer;
+
+    // 头部通常只有1字节,按实际长度预留,小缓冲区也能放下小的数据
+    unsigned char header[max_header_size];
+    size_t len = encode_header(header, flags, false, 0);
+    if (!reserve(len))
+        return false;
+    memcpy(m_pos, header, len);
+    m_pos += len;
+    m_header_len = (size_t)(m_pos - m_begin);
+    m_header_flags = flags;
+    m_session_reset = false;
+    return true;
 }
 
-int lua_archiver::load(lua_State* L, const void* data, size_t data_len) {
-    if (data_len == 0 || !alloc_buffer())
+// 写入数据头部,buffer中至少要有max_header_size字节
+size_t lua_archiver::encode_header(unsigned char* buffer, unsigned char flags, bool lz4, size_t raw_len) {
+    unsigned char* pos = buffer;
+    if (flags == 0) {
+        *pos++ = lz4 ? 'z' : 'x';
+        return 1;
+    }
+
+    *pos++ = lz4 ? 'Z' : 'X';
+    *pos++ = flags;
+    if (flags & ar_flag_dict) {
+        pos += encode_u64(pos, MAX_VARINT_SIZE, (uint64_t)m_dict_id);
+    }
+    if (flags & ar_flag_reset) {
+        pos += encode_u64(pos, MAX_VARINT_SIZE, (uint64_t)m_session_slots.size());
+    }
+    if (flags & (ar_flag_lz_stream | ar_flag_lz_block)) {
+        pos += encode_u64(pos, MAX_VARINT_SIZE, (uint64_t)raw_len);
+    }
+    return (size_t)(pos - buffer);
+}
+
+// 把[m_begin, m_pos)压缩到m_lz_buffer,返回压缩后的长度(含头部),失败返回0
+size_t lua_archiver::compress() {
+    int raw_len = (int)(m_pos - m_begin - m_header_len);
+    if (m_lz_capacity < max_header_size + (size_t)LZ4_COMPRESSBOUND(raw_len)) {
+        // 缓冲区增长过,压缩缓冲区也要随之增长
+        grow_lz_buffer(max_header_size + LZ4_COMPRESSBOUND(raw_len));
+    }
+    if (m_lz_capacity < max_header_size)
         return 0;
 
-    m_pos = (unsigned char*)data;
-    m_end = (unsigned char*)data + data_len;
+    uint64_t start = steady_ns();
+    const char* src = (const char*)m_begin + m_header_len;
+    if (m_lz_stream == nullptr && !probe_compressible(src, raw_len)) {
+        m_stats.compress_skip++;
+        m_stats.compress_ns += steady_ns() - start;
+        return 0;
+    }
 
-    if (*m_pos == 'z') {
-        m_pos++;
-        int len = LZ4_decompress_safe((const char*)m_pos, (char*)m_lz_buffer, (int)data_len - 1, (int)m_lz_buffer_size);
+    unsigned char flags = m_header_flags;
+    if (m_lz_stream) {
+        flags |= ar_flag_lz_stream | (m_lz_stream_reset ? ar_flag_lz_reset : 0);
+    } else if (m_lz_block_size > 0 && (size_t)raw_len > m_lz_block_size) {
+        size_t lz_len = compress_blocks(src, raw_len, flags | ar_flag_lz_block);
+        if (lz_len > 0) {
+            m_stats.compress_count++;
+            m_stats.compress_in += raw_len;
+            m_stats.compress_out += lz_len;
+            m_stats.compress_ns += steady_ns() - start;
+            return lz_len;
+        }
+        // 压缩缓冲区不够分块使用时,退回到整体压缩
+    }
+    size_t header_len = encode_header(m_lz_buffer, flags, true, (size_t)raw_len);
+    char* dst = (char*)m_lz_buffer + header_len;
+    int dst_capacity = (int)(m_lz_capacity - header_len);
+    int out_len = 0;
+    if (m_lz_stream) {
+        out_len = compress_stream(src, dst, raw_len, dst_capacity);
+    } else {
+        if (m_lz_state == nullptr) {
+            m_lz_state = new LZ4_stream_t;
+        }
+        out_len = LZ4_compress_fast_extState(m_lz_state, src, dst, raw_len, dst_capacity, m_lz_acceleration);
+    }
+
+    m_stats.compress_count++;
+    m_stats.compress_in += raw_len;
+    m_stats.compress_out += out_len > 0 ? out_len : 0;
+    m_stats.compress_ns += steady_ns() - start;
+    return out_len > 0 ? header_len + out_len : 0;
+}
+
+void lua_archiver::set_lz_block(size_t block_size, int threads) {
+    m_lz_block_size = std::min(block_size, (size_t)LZ4_MAX_INPUT_SIZE);
+    m_lz_threads = std::max(threads, 1);
+    delete m_lz_pool;
+    m_lz_pool = nullptr;
+}
+
+void lua_archiver::run_blocks(int count, const std::function<void(int, int)>& job) {
+    int threads = std::min(m_lz_threads, count);
+    if (threads <= 1) {
+        for (int i = 0; i < count; i++) {
+            job(0, i);
+        }
+        return;
+    }
+
+    if (m_lz_pool == nullptr) {
+        m_lz_pool = new lz_worker_pool(m_lz_threads);
+    }
+    m_lz_pool->run(count, job);
+}
+
+// 各块先并行压缩到m_lz_buffer中间隔为LZ4_COMPRESSBOUND(块大小)的位置,写好头部及索引后再依次挪到一起
+size_t lua_archiver::compress_blocks(const char* src, int src_len, unsigned char flags) {
+    int block_size = (int)m_lz_block_size;
+    int count = (src_len + block_size - 1) / block_size;
+    size_t slot_size = (size_t)LZ4_COMPRESSBOUND(block_size);
+    size_t index_size = max_header_size + MAX_VARINT_SIZE * 2 + (size_t)count * MAX_VARINT_SIZE;
+    size_t need = index_size + slot_size * count;
+    if (m_lz_capacity < need && !grow_lz_buffer(need))
+        return 0;
+    if (m_lz_capacity < need)
+        return 0;
+
+    m_lz_block_states.resize(m_lz_threads);
+    m_lz_block_lens.assign(count, 0);
+    char* slots = (char*)m_lz_buffer + index_size;
+    run_blocks(count, [&](int worker, int i) {
+        int len = std::min(block_size, src_len - i * block_size);
+        m_lz_block_lens[i] = LZ4_compress_fast_extState(&m_lz_block_states[worker], src + (size_t)i * block_size,
+            slots + slot_size * i, len, (int)slot_size, m_lz_acceleration);
+    });
+
+    unsigned char* pos = m_lz_buffer + encode_header(m_lz_buffer, flags, true, (size_t)src_len);
+    pos += encode_u64(pos, MAX_VARINT_SIZE, (uint64_t)block_size);
+    pos += encode_u64(pos, MAX_VARINT_SIZE, (uint64_t)count);
+    for (int len : m_lz_block_lens) {
         if (len <= 0)
             return 0;
+        pos += encode_u64(pos, MAX_VARINT_SIZE, (uint64_t)len);
+    }
+    for (int i = 0; i < count; i++) {
+        memmove(pos, slots + slot_size * i, m_lz_block_lens[i]);
+        pos += m_lz_block_lens[i];
+    }
+    return (size_t)(pos - m_lz_buffer);
+}
+
+// 在开头,中间,末尾各取一段试压缩,估计整体的压缩率,避免整个压缩已经压缩过的数据(比如作为字符串嵌入的图片)
+bool lua_archiver::probe_compressible(const char* src, int src_len) {
+    if (m_lz_min_ratio <= 0 || src_len < lz_probe_size * lz_probe_count * 2)
+        return true;
+
+    if (m_lz_capacity < max_header_size + (size_t)LZ4_COMPRESSBOUND(lz_probe_size))
+        return true;
+
+    if (m_lz_state == nullptr) {
+        m_lz_state = new LZ4_stream_t;
+    }
+
+    // 试压缩的结果写到m_lz_buffer中,之后会被正式压缩的结果覆盖
+    char* dst = (char*)m_lz_buffer + max_header_size;
+    int dst_capacity = (int)(m_lz_capacity - max_header_size);
+    int in_len = 0, out_len = 0;
+    for (int i = 0; i < lz_probe_count; i++) {
+        int offset = (int)((int64_t)(src_len - lz_probe_size) * i / (lz_probe_count - 1));
+        int len = LZ4_compress_fast_extState(m_lz_state, src + offset, dst, lz_probe_size, dst_capacity, m_lz_acceleration);
+        if (len <= 0)
+            return true;
+        in_len += lz_probe_size;
+        out_len += len;
+    }
+    return in_len >= out_len * m_lz_min_ratio;
+}
+
+void lua_archiver::set_lz_stream(bool enable) {
+    if (enable && m_lz_stream == nullptr) {
+        m_lz_stream = LZ4_createStream();
+        m_lz_history.resize(lz_window * 2);
+        m_lz_stream_reset = true;
+    } else if (!enable && m_lz_stream != nullptr) {
+        LZ4_freeStream(m_lz_stream);
+        m_lz_stream = nullptr;
+        m_lz_history.clear();
+        m_lz_history.shrink_to_fit();
+    }
+}
+
+// 不超过窗口大小的消息先拷贝到history中,接在之前的数据后面,history满了就用LZ4_saveDict把最后64KB挪到开头
+// 更大的消息直接压缩,之后再把它的最后64KB存到history中
+int lua_archiver::compress_stream(const char* src, char* dst, int src_len, int dst_capacity) {
+    char* history = m_lz_history.data();
+    if (m_lz_stream_reset) {
+        m_lz_stream_reset = false;
+        m_lz_history_len = std::min(m_lz_dict.size(), (size_t)lz_window);
+        memcpy(history, m_lz_dict.data() + m_lz_dict.size() - m_lz_history_len, m_lz_history_len);
+        LZ4_resetStream(m_lz_stream);
+        LZ4_loadDict(m_lz_stream, history, (int)m_lz_history_len);
+    }
+
+    int out_len = 0;
+    if (src_len > lz_window) {
+        out_len = LZ4_compress_fast_continue(m_lz_stream, src, dst, src_len, dst_capacity, m_lz_acceleration);
+        m_lz_history_len = (size_t)LZ4_saveDict(m_lz_stream, history, lz_window);
+    } else {
+        if (m_lz_history_len + src_len > m_lz_history.size()) {
+            m_lz_history_len = (size_t)LZ4_saveDict(m_lz_stream, history, lz_window);
+        }
+        memcpy(history + m_lz_history_len, src, src_len);
+        out_len = LZ4_compress_fast_continue(m_lz_stream, history + m_lz_history_len, dst, src_len, dst_capacity, m_lz_acceleration);
+        m_lz_history_len += src_len;
+    }
+
+    if (out_len <= 0) {
+        // 失败后压缩状态不可靠,只能重新开始
+        m_lz_stream_reset = true;
+    }
+    return out_len;
+}
+
+// 解压成功后m_pos,m_end指向解压后的数据
+bool lua_archiver::decompress(const char* src, int src_len) {
+    uint64_t start = steady_ns();
+    if (m_load_flags & ar_flag_lz_stream) {
+        if (!decompress_stream(src, src_len))
+            return false;
+    } else if (m_load_flags & ar_flag_lz_block) {
+        if (!decompress_blocks(src, src_len))
+            return false;
+    } else {
+        int len = LZ4_decompress_safe(src, (char*)m_lz_buffer, src_len, (int)m_lz_capacity);
+        // 数据中没有记录解压后的长度,解压失败时扩大缓冲区重试,直到上限
+        while (len < 0 && m_lz_capacity < m_max_buffer_size && grow_lz_buffer(m_lz_capacity * 2)) {
+            len = LZ4_decompress_safe(src, (char*)m_lz_buffer, src_len, (int)m_lz_capacity);
+        }
+        if (len <= 0)
+            return false;
         m_pos = m_lz_buffer;
         m_end = m_lz_buffer + len;
+    }
+
+    m_stats.decompress_count++;
+    m_stats.decompress_in += src_len;
+    m_stats.decompress_out += (uint64_t)(m_end - m_pos);
+    m_stats.decompress_ns += steady_ns() - start;
+    return true;
+}
+
+// 各块的长度已经在load_header中读到m_lz_block_lens中
+bool lua_archiver::decompress_blocks(const char* src, int src_len) {
+    int raw_len = (int)m_lz_raw_len;
+    if (m_lz_capacity < (size_t)raw_len && !grow_lz_buffer((size_t)raw_len))
+        return false;
+    if (m_lz_capacity < (size_t)raw_len)
+        return false;
+
+    int count = (int)m_lz_block_lens.size();
+    std::vector<int> offsets(count);
+    int offset = 0;
+    for (int i = 0; i < count; i++) {
+        offsets[i] = offset;
+        offset += m_lz_block_lens[i];
+    }
+    if (offset != src_len)
+        return false;
+
+    int block_size = (int)m_load_block_size;
+    std::atomic<bool> ok{ true };
+    run_blocks(count, [&](int, int i) {
+        int len = std::min(block_size, raw_len - i * block_size);
+        char* dst = (char*)m_lz_buffer + (size_t)i * block_size;
+        if (LZ4_decompress_safe(src + offsets[i], dst, m_lz_block_lens[i], len) != len) {
+            ok = false;
+        }
+    });
+    if (!ok)
+        return false;
+
+    m_pos = m_lz_buffer;
+    m_end = m_lz_buffer + raw_len;
+    return true;
+}
+
+// load端只要保证解压时能引用到之前64KB以内的数据,不必与save端的history布局一致
+bool lua_archiver::decompress_stream(const char* src, int src_len) {
+    int raw_len = (int)m_lz_raw_len;
+    char* history = m_lz_load_history.data();
+    if (m_lz_load_history_len + raw_len > m_lz_load_history.size()) {
+        size_t keep = std::min(m_lz_load_history_len, (size_t)lz_window);
+        memmove(history, history + m_lz_load_history_len - keep, keep);
+        m_lz_load_history_len = keep;
+        LZ4_setStreamDecode(m_lz_stream_decode, history, (int)keep);
+    }
+
+    char* dst = history + m_lz_load_history_len;
+    if (raw_len > lz_window) {
+        // 比窗口大的消息解压到m_lz_buffer,之后把最后64KB留作历史
+        if (m_lz_capacity < (size_t)raw_len && !grow_lz_buffer((size_t)raw_len))
+            return false;
+        dst = (char*)m_lz_buffer;
+    }
+
+    int len = LZ4_decompress_safe_continue(m_lz_stream_decode, src, dst, src_len, raw_len);
+    if (len != raw_len) {
+        // 状态已经不可靠,直到收到重置的消息为止
+        m_lz_load_history.clear();
+        return false;
+    }
+
+    if (dst == (char*)m_lz_buffer) {
+        memcpy(history, dst + raw_len - lz_window, lz_window);
+        m_lz_load_history_len = lz_window;
+        LZ4_setStreamDecode(m_lz_stream_decode, history, lz_window);
     } else {
-        if (*m_pos != 'x')
+        m_lz_load_history_len += raw_len;
+    }
+    m_pos = (unsigned char*)dst;
+    m_end = (unsigned char*)dst + raw_len;
+    return true;
+}
+
+int lua_archiver::load(lua_State* L, const void* data, size_t data_len) {
+    if (!luna_trace_enabled())
+        return load_data(L, data, data_len);
+
+    uint64_t start = luna_trace_now();
+    int count = load_data(L, data, data_len);
+    luna_trace_complete("archiver", "load", start, "bytes", (int64_t)data_len, "lz4", data_len > 0 && is_lz4(*(const unsigned char*)data));
+    return count;
+}
+
+int lua_archiver::load_data(lua_State* L, const void* data, size_t data_len) {
+    shrink_buffer(false);
+    if (data_len == 0 || !alloc_buffer())
+        return 0;
+
+    m_pos = (unsigned char*)data;
+    m_end = (unsigned char*)data + data_len;
+
+    unsigned char head = *m_pos;
+    if (!load_header())
+        return 0;
+    note_data_size(m_lz_raw_len > 0 ? m_lz_raw_len : data_len);
+
+    m_load_pending = 0;
+    m_load_anchor = 0;
+    bool streaming = m_streaming_load && (m_load_flags & ar_flag_lz_block);
+    if (streaming) {
+        size_t src_len = 0;
+        for (int len : m_lz_block_lens) {
+            src_len += len;
+        }
+        if (src_len != (size_t)(m_end - m_pos))
             return 0;
-        m_pos++;
+        // 块大小和原始长度来自消息头,与其他load路径一样不能超过缓冲区的上限
+        size_t limit = std::max(m_lz_buffer_size, m_max_buffer_size);
+        if (m_load_block_size > limit || m_lz_raw_len > limit)
+            return 0;
+        m_load_src = (const char*)m_pos;
+        m_load_block_next = 0;
+        m_load_pending = m_lz_raw_len;
+        m_load_window.resize(std::min(m_load_block_size, m_lz_raw_len) * 2);
+        m_pos = m_end = m_load_window.data();
+        m_stats.decompress_count++;
+        m_stats.decompress_in += src_len;
+    } else if (is_lz4(head)) {
+        if (!decompress((const char*)m_pos, (int)(m_end - m_pos)))
+            return 0;
+    } else if (head != 'x' && head != 'X') {
+        return 0;
     }
 
     m_shared_string.clear();
@@ -142,23 +836,175 @@ int lua_archiver::load(lua_State* L, const void* data, size_t data_len) {
 
     int count = 0;
     int top = lua_gettop(L);
-    while (m_pos < m_end) {
-        if (!load_value(L)) {
-            lua_settop(L, top);
-            return 0;
-        }
+    bool table_ref = (m_load_flags & ar_flag_table_ref) != 0;
+    if ((streaming || table_ref) && !lua_checkstack(L, 2))
+        return 0;
+    if (streaming) {
+        lua_newtable(L);
+        m_load_anchor = lua_gettop(L);
+    }
+    if (table_ref) {
+        lua_newtable(L);
+        m_load_refs = lua_gettop(L);
+        m_load_table_count = 0;
+    }
+    // 锚表和引用表压在load出来的值下面,最后要去掉
+    int helper_count = lua_gettop(L) - top;
+
+    bool ok = true;
+    while (ok && load_need(sizeof(unsigned char))) {
+        ok = load_value(L);
         count++;
     }
+
+    if (streaming) {
+        m_load_anchor = 0;
+        // 大字符串可能让窗口扩大过,不要一直占着
+        if (m_load_window.size() > m_load_block_size * 4) {
+            std::vector<unsigned char>().swap(m_load_window);
+        }
+    }
+    m_load_refs = 0;
+
+    if (!ok) {
+        lua_settop(L, top);
+        return 0;
+    }
+    for (int i = 0; i < helper_count; i++) {
+        lua_remove(L, top + 1);
+    }
     return count;
 }
 
+// 把窗口中剩下的数据挪到开头,再依次解压后面的块接在后面,直到够size字节为止(大字符串需要时扩大窗口)
+bool lua_archiver::load_refill(size_t size) {
+    if (m_load_pending == 0)
+        return false;
+
+    uint64_t start = steady_ns();
+    size_t left = (size_t)(m_end - m_pos);
+    memmove(m_load_window.data(), m_pos, left);
+    while (left < size && m_load_pending > 0) {
+        size_t i = m_load_block_next++;
+        int len = (int)std::min((uint64_t)m_load_block_size, m_load_pending);
+        if (m_load_window.size() < left + len) {
+            m_load_window.resize(std::max(m_load_window.size() * 2, left + len));
+        }
+        char* dst = (char*)m_load_window.data() + left;
+        if (LZ4_decompress_safe(m_load_src, dst, m_lz_block_lens[i], len) != len) {
+            m_load_pending = 0;
+            m_pos = m_end = m_load_window.data();
+            return false;
+        }
+        m_load_src += m_lz_block_lens[i];
+        m_load_pending -= len;
+        m_stats.decompress_out += len;
+        left += len;
+    }
+    m_pos = m_load_window.data();
+    m_end = m_pos + left;
+    m_stats.decompress_ns += steady_ns() - start;
+    return left >= size;
+}
+
+bool lua_archiver::load_header() {
+    unsigned char head = *m_pos++;
+    m_dict_base = 0;
+    m_message_base = 0;
+    m_load_in_session = false;
+    m_lz_raw_len = 0;
+    m_load_flags = 0;
+    if (head == 'x' || head == 'z')
+        return true;
+
+    if ((head != 'X' && head != 'Z') || m_pos >= m_end)
+        return false;
+
+    unsigned char flags = *m_pos++;
+    m_load_flags = flags;
+    if (flags & ar_flag_dict) {
+        uint64_t dict_id = 0;
+        size_t decode_len = decode_u64(&dict_id, m_pos, (size_t)(m_end - m_pos));
+        if (decode_len == 0 || m_dict_strings.empty() || dict_id != (uint64_t)m_dict_id)
+            return false;
+        m_pos += decode_len;
+        m_dict_base = (int)m_dict_strings.size();
+    }
+
+    if (flags & ar_flag_reset) {
+        uint64_t session_size = 0;
+        size_t decode_len = decode_u64(&session_size, m_pos, (size_t)(m_end - m_pos));
+        if (decode_len == 0 || session_size == 0 || session_size > max_session_size)
+            return false;
+        m_pos += decode_len;
+        m_load_session.clear();
+        m_load_session.resize((size_t)session_size);
+    }
+
+    m_message_base = m_dict_base;
+    if (flags & ar_flag_session) {
+        if (m_load_session.empty())
+            return false;
+        m_load_in_session = true;
+        m_message_base += (int)m_load_session.size();
+    }
+
+    if (flags & (ar_flag_lz_stream | ar_flag_lz_block)) {
+        uint64_t raw_len = 0;
+        size_t decode_len = decode_u64(&raw_len, m_pos, (size_t)(m_end - m_pos));
+        if (head != 'Z' || decode_len == 0 || raw_len == 0 || raw_len > INT_MAX)
+            return false;
+        m_pos += decode_len;
+        m_lz_raw_len = (size_t)raw_len;
+    }
+
+    if (flags & ar_flag_lz_block) {
+        uint64_t block_size = 0, count = 0, block_len = 0;
+        size_t decode_len = decode_u64(&block_size, m_pos, (size_t)(m_end - m_pos));
+        if (decode_len == 0 || block_size == 0 || block_size > INT_MAX)
+            return false;
+        m_pos += decode_len;
+        decode_len = decode_u64(&count, m_pos, (size_t)(m_end - m_pos));
+        if (decode_len == 0 || count != (m_lz_raw_len + block_size - 1) / block_size || count > (uint64_t)(m_end - m_pos))
+            return false;
+        m_pos += decode_len;
+        m_load_block_size = (size_t)block_size;
+        m_lz_block_lens.resize((size_t)count);
+        for (auto& len : m_lz_block_lens) {
+            decode_len = decode_u64(&block_len, m_pos, (size_t)(m_end - m_pos));
+            if (decode_len == 0 || block_len == 0 || block_len > (uint64_t)(m_end - m_pos))
+                return false;
+            m_pos += decode_len;
+            len = (int)block_len;
+        }
+    }
+
+    if (flags & ar_flag_lz_stream) {
+        if (flags & ar_flag_lz_reset) {
+            if (m_lz_stream_decode == nullptr) {
+                m_lz_stream_decode = LZ4_createStreamDecode();
+            }
+            m_lz_load_history.resize(lz_window * 2);
+            m_lz_load_history_len = std::min(m_lz_dict.size(), (size_t)lz_window);
+            memcpy(m_lz_load_history.data(), m_lz_dict.data() + m_lz_dict.size() - m_lz_load_history_len, m_lz_load_history_len);
+            LZ4_setStreamDecode(m_lz_stream_decode, m_lz_load_history.data(), (int)m_lz_load_history_len);
+        }
+
+        if (m_lz_load_history.empty())
+            return false;
+    }
+    return true;
+}
+
 bool lua_archiver::alloc_buffer() {
     if (m_ar_buffer == nullptr) {
         m_ar_buffer = new unsigned char[m_ar_buffer_size];
+        m_ar_capacity = m_ar_buffer_size;
     }
 
     if (m_lz_buffer == nullptr) {
         m_lz_buffer = new unsigned char[m_lz_buffer_size];
+        m_lz_capacity = m_lz_buffer_size;
     }
     
     return m_ar_buffer != nullptr && m_lz_buffer != nullptr;
@@ -168,14 +1014,122 @@ void lua_archiver::free_buffer() {
     if (m_ar_buffer) {
         delete[] m_ar_buffer;
         m_ar_buffer = nullptr;
+        m_ar_capacity = 0;
     }
 
     if (m_lz_buffer) {
         delete[] m_lz_buffer;
         m_lz_buffer = nullptr;
+        m_lz_capacity = 0;
     }
 }
 
+// 超过初始大小的数据会让计数清零
+void lua_archiver::note_data_size(size_t size) {
+    m_small_count = size <= m_ar_buffer_size ? std::min(m_small_count + 1, shrink_after) : 0;
+}
+
+// 让偶尔出现的大消息不会一直占用大缓冲区,连续shrink_after次数据都不大才恢复,避免大消息每次都重新增长
+// load只用到压缩缓冲区,所以不动m_ar_buffer(其中可能是上次save的结果)
+void lua_archiver::shrink_buffer(bool shrink_ar) {
+    if (m_small_count < shrink_after)
+        return;
+
+    if (shrink_ar && m_ar_capacity > m_ar_buffer_size) {
+        delete[] m_ar_buffer;
+        m_ar_buffer = nullptr;
+        m_ar_capacity = 0;
+    }
+
+    if (m_lz_capacity > m_lz_buffer_size) {
+        delete[] m_lz_buffer;
+        m_lz_buffer = nullptr;
+        m_lz_capacity = 0;
+    }
+}
+
+// save过程中空间不足: 按倍数扩大m_ar_buffer,保留已写入的数据
+bool lua_archiver::grow_buffer(size_t size) {
+    if (m_sink != nullptr)
+        return grow_sink(size);
+
+    if (m_begin != m_ar_buffer || m_ar_capacity >= m_max_buffer_size)
+        return false;
+
+    size_t used = (size_t)(m_pos - m_begin);
+    size_t capacity = m_ar_capacity;
+    while (capacity - used < size && capacity < m_max_buffer_size) {
+        capacity = std::min(capacity * 2, m_max_buffer_size);
+    }
+    if (capacity - used < size)
+        return false;
+
+    auto buffer = new unsigned char[capacity];
+    memcpy(buffer, m_ar_buffer, used);
+    delete[] m_ar_buffer;
+    m_ar_buffer = buffer;
+    m_ar_capacity = capacity;
+    m_begin = buffer;
+    m_pos = buffer + used;
+    m_end = buffer + capacity;
+    return true;
+}
+
+bool lua_archiver::grow_lz_buffer(size_t size) {
+    size_t limit = 1 + LZ4_COMPRESSBOUND(m_max_buffer_size);
+    size = std::min(size, limit);
+    if (size <= m_lz_capacity)
+        return false;
+
+    delete[] m_lz_buffer;
+    m_lz_buffer = new unsigned char[size];
+    m_lz_capacity = size;
+    return true;
+}
+
+// 向调用者的sink中save时空间不足: 扩大sink,m_begin之前是sink中原有的内容
+// 与写入m_ar_buffer一样,写入的数据不超过max(缓冲区初始大小, m_max_buffer_size)
+bool lua_archiver::grow_sink(size_t size) {
+    size_t used = (size_t)(m_pos - m_begin);
+    size_t limit = std::max(m_ar_buffer_size, m_max_buffer_size);
+    if (used > limit || size > limit - used)
+        return false;
+
+    size_t need = m_sink_base + used + size;
+    m_sink->resize(std::min(std::max(m_sink->size() * 2, need), m_sink_base + limit));
+    m_begin = (unsigned char*)&(*m_sink)[m_sink_base];
+    m_pos = m_begin + used;
+    m_end = (unsigned char*)&(*m_sink)[0] + m_sink->size();
+    return true;
+}
+
+// 先在剩余空间中编码,放不下时才按编码后的实际长度扩大缓冲区
+bool lua_archiver::save_u64(uint64_t v) {
+    size_t len = encode_u64(m_pos, (size_t)(m_end - m_pos), v);
+    if (len == 0) {
+        unsigned char buffer[MAX_VARINT_SIZE];
+        len = encode_u64(buffer, sizeof(buffer), v);
+        if (!reserve(len))
+            return false;
+        memcpy(m_pos, buffer, len);
+    }
+    m_pos += len;
+    return true;
+}
+
+bool lua_archiver::save_s64(int64_t v) {
+    size_t len = encode_s64(m_pos, (size_t)(m_end - m_pos), v);
+    if (len == 0) {
+        unsigned char buffer[MAX_VARINT_SIZE];
+        len = encode_s64(buffer, sizeof(buffer), v);
+        if (!reserve(len))
+            return false;
+        memcpy(m_pos, buffer, len);
+    }
+    m_pos += len;
+    return true;
+}
+
 bool lua_archiver::save_value(lua_State* L, int idx) {
     int type = lua_type(L, idx);
     switch (type) {
@@ -201,7 +1155,7 @@ bool lua_archiver::save_value(lua_State* L, int idx) {
 }
 
 bool lua_archiver::save_number(double v) {
-    if (m_end - m_pos < sizeof(unsigned char) + sizeof(double))
+    if (!reserve(sizeof(unsigned char) + sizeof(double)))
         return false;
     *m_pos++ = (unsigned char)ar_type::number;
     uint64_t ni64 = htonll(*(uint64_t*)&v);
@@ -212,7 +1166,7 @@ bool lua_archiver::save_number(double v) {
 
 bool lua_archiver::save_integer(int64_t v) {
     if (v >= 0 && v <= small_int_max) {
-        if (m_end - m_pos < sizeof(unsigned char))
+        if (!reserve(sizeof(unsigned char)))
             return false;
         *m_pos++ = (unsigned char)(v + (int)ar_type::count);
         return true;
@@ -222,115 +1176,386 @@ bool lua_archiver::save_integer(int64_t v) {
         v -= small_int_max;
     }
 
-    if (m_end - m_pos < sizeof(unsigned char))
+    if (!reserve(sizeof(unsigned char)))
         return false;
     *m_pos++ = (unsigned char)ar_type::integer;
-    size_t len = encode_s64(m_pos, (size_t)(m_end - m_pos), v);
-    m_pos += len;
-    return len > 0;
+    return save_s64(v);
 }
 
 bool lua_archiver::save_bool(bool v) {
-    if (m_end - m_pos < sizeof(unsigned char))
+    if (!reserve(sizeof(unsigned char)))
         return false;
     *m_pos++ = (unsigned char)(v ? ar_type::bool_true : ar_type::bool_false);
     return true;
 }
 
 bool lua_archiver::save_nil() {
-    if (m_end - m_pos < sizeof(unsigned char))
+    if (!reserve(sizeof(unsigned char)))
         return false;
     *m_pos++ = (unsigned char)ar_type::nil;
     return true;
 }
 
-// table: table_head + lhsize + narr + (k,v)... + table_tail
+// table: table_head + table_segment/table_packed_xxx + narr + nhash + 数组部分(1..narr)的值 + 其余的(k,v)...
+// 数组部分不写key,按顺序写值(空洞写nil); nhash为其余键值对的准确个数
 bool lua_archiver::save_table(lua_State* L, int idx) {
+    if (m_table_ref) {
+        // 序号按table第一次出现(开始写入)的顺序分配,与load时创建table的顺序一致
+        const void* table = lua_topointer(L, idx);
+        auto it = m_table_refs.find(table);
+        if (it != m_table_refs.end()) {
+            if (!reserve(sizeof(unsigned char) * 2))
+                return false;
+            *m_pos++ = (unsigned char)ar_type::table_head;
+            *m_pos++ = table_ref;
+            return save_u64((uint64_t)it->second);
+        }
+        m_table_refs.emplace(table, (int)m_table_refs.size() + 1);
+    }
+
     if (++m_table_depth > max_table_depth)
         return false;
 
-    if (m_end - m_pos < (ptrdiff_t)sizeof(unsigned char) * 2)
+    if (!reserve(sizeof(unsigned char) * 2))
         return false;
 
     idx = normal_index(L, idx);
     *m_pos++ = (unsigned char)ar_type::table_head;
-    unsigned char* lhsize = m_pos++;
-    uint64_t narr = (uint64_t)luaL_len(L, idx);
-    size_t encode_len = encode_u64(m_pos, (size_t)(m_end - m_pos), narr);
-    if (encode_len == 0)
+    size_t marker_pos = (size_t)(m_pos - m_begin);
+    *m_pos++ = table_segment;
+    lua_Integer narr = (lua_Integer)lua_rawlen(L, idx);
+    if (!save_u64((uint64_t)narr) || !reserve(sizeof(unsigned char)))
         return false;
-    m_pos += encode_len;
+    // nhash要写完才知道,先占一个字节; 缓冲区可能增长,只能记录偏移
+    size_t nhash_pos = (size_t)(m_pos++ - m_begin);
 
-    if (!lua_checkstack(L, 1))
+    if (!lua_checkstack(L, 2))
         return false;
 
-    int size = 0;
+    if (!save_array(L, idx, narr, marker_pos))
+        return false;
+
+    uint64_t nhash = 0;
     lua_pushnil(L);
     while (lua_next(L, idx)) {
+        if (lua_isinteger(L, -2)) {
+            lua_Integer key = lua_tointeger(L, -2);
+            if (key >= 1 && key <= narr) {
+                lua_pop(L, 1);
+                continue;
+            }
+        }
         if (!save_value(L, -2) || !save_value(L, -1))
             return false;
-        ++size;
+        ++nhash;
         lua_pop(L, 1);
     }
 
-    // 考虑数组出现空洞的情况,narr未必是准确的,可能出现narr>size的情况
-    // 由于这里的hsize只是作为load时预留之用,所以这种情况下记为0
-    *lhsize = (unsigned char)fast_log2((unsigned)(size > narr ? size - narr : 0));
+    if (!save_count(nhash_pos, nhash))
+        return false;
 
     --m_table_depth;
+    return true;
+}
 
-    if (m_end - m_pos < (ptrdiff_t)sizeof(unsigned char))
-        return false;
-    *m_pos++ = (unsigned char)ar_type::table_tail;
+bool lua_archiver::save_array(lua_State* L, int idx, lua_Integer narr, size_t marker_pos) {
+    if (narr >= packed_array_min) {
+        lua_rawgeti(L, idx, 1);
+        unsigned char marker = packed_kind(L, -1);
+        lua_pop(L, 1);
+        if (marker != table_segment) {
+            size_t start = (size_t)(m_pos - m_begin);
+            int ret = save_packed(L, idx, narr, marker);
+            if (ret < 0)
+                return false;
+            if (ret > 0) {
+                m_begin[marker_pos] = marker;
+                return true;
+            }
+            // 类型不一致,丢掉已写的部分,退回普通格式
+            m_pos = m_begin + start;
+        }
+    }
+
+    for (lua_Integer i = 1; i <= narr; i++) {
+        lua_rawgeti(L, idx, i);
+        if (!save_value(L, -1))
+            return false;
+        lua_pop(L, 1);
+    }
+    return true;
+}
+
+// 返回1表示写入成功,0表示数组中有不同类型的值(或者整数块放不下,退回普通格式),-1表示缓冲区不够
+int lua_archiver::save_packed(lua_State* L, int idx, lua_Integer narr, unsigned char marker) {
+    uint64_t values[pack_chunk];
+    uint64_t deltas[pack_chunk];
+    uint64_t prev = 0;
+    for (lua_Integer first = 1; first <= narr; first += pack_chunk) {
+        int count = (int)std::min((lua_Integer)pack_chunk, narr - first + 1);
+        for (int i = 0; i < count; i++) {
+            lua_rawgeti(L, idx, first + i);
+            if (packed_kind(L, -1) != marker) {
+                lua_pop(L, 1);
+                return 0;
+            }
+            if (marker == table_packed_int) {
+                values[i] = (uint64_t)lua_tointeger(L, -1);
+            } else if (marker == table_packed_double) {
+                double v = (double)lua_tonumber(L, -1);
+                memcpy(&values[i], &v, sizeof(v));
+            } else {
+                values[i] = lua_toboolean(L, -1) ? 1 : 0;
+            }
+            lua_pop(L, 1);
+        }
+
+        if (marker == table_packed_int) {
+            delta_zigzag(values, deltas, count, prev);
+            prev = values[count - 1];
+            // 先直接写入剩余空间,不够时才编码到临时缓冲区,按实际长度扩大缓冲区,而不是按每个数最坏的情况预留
+            size_t len = encode_u64_batch(m_pos, (size_t)(m_end - m_pos), deltas, (size_t)count);
+            if (len == 0) {
+                unsigned char encoded[pack_chunk * MAX_VARINT_SIZE];
+                len = encode_u64_batch(encoded, sizeof(encoded), deltas, (size_t)count);
+                if (!reserve(len))
+                    return 0;
+                memcpy(m_pos, encoded, len);
+            }
+            m_pos += len;
+        } else if (marker == table_packed_double) {
+            if (!reserve((size_t)count * sizeof(uint64_t)))
+                return -1;
+            for (int i = 0; i < count; i++) {
+                values[i] = htolell(values[i]);
+            }
+            memcpy(m_pos, values, (size_t)count * sizeof(uint64_t));
+            m_pos += (size_t)count * sizeof(uint64_t);
+        } else {
+            if (!reserve((size_t)(count + 7) / 8))
+                return -1;
+            pack_bits(values, count, m_pos);
+            m_pos += (count + 7) / 8;
+        }
+    }
+    return 1;
+}
+
+// 把count写到之前在pos处预留的一个字节中,一个字节放不下时,把pos之后已经写入的数据往后挪
+bool lua_archiver::save_count(size_t pos, uint64_t count) {
+    unsigned char buffer[MAX_VARINT_SIZE];
+    size_t len = encode_u64(buffer, sizeof(buffer), count);
+    if (len > 1) {
+        size_t shift = len - 1;
+        if (!reserve(shift))
+            return false;
+        size_t tail = (size_t)(m_pos - m_begin) - pos - 1;
+        memmove(m_begin + pos + len, m_begin + pos + 1, tail);
+        m_pos += shift;
+        for (auto& ref : m_iov_refs) {
+            if (ref.offset > pos) {
+                ref.offset += shift;
+            }
+        }
+    }
+    memcpy(m_begin + pos, buffer, len);
     return true;
 }
 
 bool lua_archiver::save_string(lua_State* L, int idx) {
-    size_t len = 0, encode_len = 0;
+    size_t len = 0;
     const char* str = lua_tolstring(L, idx, &len);
-    int shared = find_shared_str(str);
+    int shared = intern_shared_str(str, len);
     if (shared >= 0) {
-        if (m_end - m_pos < sizeof(unsigned char))
+        if (!reserve(sizeof(unsigned char)))
             return false;
         *m_pos++ = (unsigned char)ar_type::string_idx;
-        encode_len = encode_u64(m_pos, (size_t)(m_end - m_pos), shared);
-        m_pos += encode_len;
-        return encode_len > 0;
+        return save_u64((uint64_t)shared);
     }
 
-    if (m_end - m_pos < sizeof(unsigned char))
+    if (!reserve(sizeof(unsigned char)))
         return false;
     *m_pos++ = (unsigned char)ar_type::string;
 
-    encode_len = encode_u64(m_pos, (size_t)(m_end - m_pos), len);
-    if (encode_len == 0)
+    // 会话模式下,字符串前面是其占用的会话槽位+1(0表示不进入会话表),原来槽位上的字符串即被淘汰
+    if (!m_session_slots.empty() && !save_u64((uint64_t)(m_session_define + 1)))
         return false;
-    m_pos += encode_len;
 
-    if (m_end - m_pos < (int)len)
+    if (!save_u64(len))
         return false;
-    memcpy(m_pos, str, len);
-    m_pos += len;
 
-    if (m_shared_string.size() < max_share_string) {
-        m_shared_string.push_back(str);
+    if (m_iov_mode && len >= m_iov_threshold) {
+        m_iov_refs.push_back({ (size_t)(m_pos - m_begin), str, len });
+    } else {
+        if (!reserve(len))
+            return false;
+        memcpy(m_pos, str, len);
+        m_pos += len;
     }
-
     return true;
 }
 
-int lua_archiver::find_shared_str(const char* str) {
-    auto it = std::find(m_shared_string.begin(), m_shared_string.end(), str);
-    if (it != m_shared_string.end())
-        return (int)(it - m_shared_string.begin());
+void lua_archiver::set_dictionary(int id, const std::vector<std::string>& strings) {
+    m_dict_id = id;
+    m_dict_index.clear();
+    m_dict_strings = strings;
+    m_dict_max_len = 0;
+    for (size_t i = 0; i < m_dict_strings.size(); i++) {
+        const std::string& str = m_dict_strings[i];
+        m_dict_index.emplace(std::string_view(str), (int)i);
+        m_dict_max_len = std::max(m_dict_max_len, str.size());
+    }
+}
+
+void lua_archiver::set_session(int max_strings, size_t max_len) {
+    m_session_slots.clear();
+    m_session_slots.resize(max_strings > 0 ? (size_t)max_strings : 0);
+    m_session_max_len = max_len;
+    reset_session();
+}
+
+void lua_archiver::reset_session() {
+    m_session_index.clear();
+    m_session_fill = 0;
+    m_session_head = -1;
+    m_session_tail = -1;
+    m_session_reset = true;
+}
+
+// 命中时移到LRU链表头部,返回其序号; 未命中时占用一个空闲(或最久未用的)槽位,记在m_session_define中,返回-1
+int lua_archiver::find_session_str(const char* str, size_t len) {
+    if (len > m_session_max_len)
+        return -1;
+
+    auto it = m_session_index.find(std::string_view(str, len));
+    if (it != m_session_index.end()) {
+        int slot = it->second;
+        unlink_session_slot(slot);
+        link_session_slot(slot);
+        m_session_slots[slot].gen = m_session_gen;
+        return m_dict_base + slot;
+    }
+
+    int slot = m_session_tail;
+    if (m_session_fill < (int)m_session_slots.size()) {
+        slot = m_session_fill++;
+    } else {
+        // 最久未用的也是本次用到的,说明本次用到了全部槽位,淘汰会让前面的引用失效
+        if (m_session_slots[slot].gen == m_session_gen)
+            return -1;
+        m_session_index.erase(std::string_view(m_session_slots[slot].str));
+        unlink_session_slot(slot);
+    }
+
+    session_slot& node = m_session_slots[slot];
+    node.str.assign(str, len);
+    node.gen = m_session_gen;
+    m_session_index.emplace(std::string_view(node.str), slot);
+    link_session_slot(slot);
+    m_session_define = slot;
     return -1;
 }
 
+void lua_archiver::link_session_slot(int slot) {
+    session_slot& node = m_session_slots[slot];
+    node.prev = -1;
+    node.next = m_session_head;
+    if (m_session_head >= 0) {
+        m_session_slots[m_session_head].prev = slot;
+    }
+    m_session_head = slot;
+    if (m_session_tail < 0) {
+        m_session_tail = slot;
+    }
+}
+
+void lua_archiver::unlink_session_slot(int slot) {
+    session_slot& node = m_session_slots[slot];
+    if (node.prev >= 0) {
+        m_session_slots[node.prev].next = node.next;
+    } else {
+        m_session_head = node.next;
+    }
+    if (node.next >= 0) {
+        m_session_slots[node.next].prev = node.prev;
+    } else {
+        m_session_tail = node.prev;
+    }
+}
+
+void lua_archiver::set_max_shared_string(int count) {
+    m_max_shared_string = count;
+    m_shared_slots.clear();
+}
+
+// 表的大小取不小于2倍上限的2的幂,保证装载率不超过一半
+void lua_archiver::reset_shared_str() {
+    m_shared_count = 0;
+    m_shared_used = 0;
+    if (m_max_shared_string <= 0)
+        return;
+
+    if (m_shared_slots.empty()) {
+        m_shared_bits = (int)fast_log2((uint32_t)m_max_shared_string * 2);
+        m_shared_slots.assign((size_t)1 << m_shared_bits, shared_slot{ nullptr, 0, 0 });
+        m_shared_gen = 0;
+    }
+
+    if (++m_shared_gen == 0) {
+        // 代数回绕,旧的记录可能被误认,只能真的清空一次
+        std::fill(m_shared_slots.begin(), m_shared_slots.end(), shared_slot{ nullptr, 0, 0 });
+        m_shared_gen = 1;
+    }
+}
+
+// 已共享过的字符串(或字典,会话表中的字符串)返回其序号; 否则返回-1,需要完整写出
+// 完整写出的字符串按先后编号,与load时按出现顺序记录的序号一致; 字典与会话表只在字符串本次第一次出现时查找
+int lua_archiver::intern_shared_str(const char* str, size_t len) {
+    shared_slot* slot = nullptr;
+    m_session_define = -1;
+    if (m_max_shared_string > 0) {
+        size_t mask = m_shared_slots.size() - 1;
+        size_t pos = (size_t)(((uint64_t)(uintptr_t)str * 0x9E3779B97F4A7C15ull) >> (64 - m_shared_bits)) & mask;
+        while (m_shared_slots[pos].gen == m_shared_gen) {
+            if (m_shared_slots[pos].str == str)
+                return m_shared_slots[pos].idx;
+            pos = (pos + 1) & mask;
+        }
+        slot = &m_shared_slots[pos];
+    }
+
+    int idx = find_dict_str(str, len);
+    if (idx < 0 && !m_session_slots.empty()) {
+        idx = find_session_str(str, len);
+    }
+
+    int shared_idx = idx;
+    if (idx < 0) {
+        int n = m_shared_count++;
+        shared_idx = m_session_define >= 0 ? m_dict_base + m_session_define : m_message_base + n;
+    }
+
+    if (slot != nullptr && m_shared_used < m_max_shared_string) {
+        slot->str = str;
+        slot->gen = m_shared_gen;
+        slot->idx = shared_idx;
+        m_shared_used++;
+    }
+    return idx;
+}
+
+int lua_archiver::find_dict_str(const char* str, size_t len) {
+    if (len > m_dict_max_len || m_dict_index.empty())
+        return -1;
+    auto it = m_dict_index.find(std::string_view(str, len));
+    return it != m_dict_index.end() ? it->second : -1;
+}
+
 bool lua_archiver::load_value(lua_State* L, bool can_be_nil) {
-    if (!lua_checkstack(L, 1))
+    if (!lua_checkstack(L, 2))
         return false;
 
-    if (m_end - m_pos < (ptrdiff_t)sizeof(unsigned char))
+    if (!load_need(sizeof(unsigned char)))
         return false;
 
     int code = *m_pos++;
@@ -350,7 +1575,7 @@ bool lua_archiver::load_value(lua_State* L, bool can_be_nil) {
         break;
 
     case ar_type::number: {        
-        if (m_end - m_pos < (ptrdiff_t)sizeof(int64_t))
+        if (!load_need(sizeof(int64_t)))
             return false;
         uint64_t i64 = 0;       
         memcpy(&i64, m_pos, sizeof(i64));
@@ -362,6 +1587,7 @@ bool lua_archiver::load_value(lua_State* L, bool can_be_nil) {
 
     case ar_type::integer: {
         int64_t integer = 0;
+        load_peek(MAX_VARINT_SIZE);
         decode_len = decode_s64(&integer, m_pos, (size_t)(m_end - m_pos));
         if (decode_len == 0)
             return false;
@@ -381,24 +1607,50 @@ bool lua_archiver::load_value(lua_State* L, bool can_be_nil) {
         lua_pushboolean(L, false);
         break;
 
-    case ar_type::string:
+    case ar_type::string: {
+        uint64_t session_slot = 0;
+        load_peek(MAX_VARINT_SIZE * 2);
+        if (m_load_in_session) {
+            decode_len = decode_u64(&session_slot, m_pos, (size_t)(m_end - m_pos));
+            if (decode_len == 0 || session_slot > m_load_session.size())
+                return false;
+            m_pos += decode_len;
+        }
         decode_len = decode_u64(&str_len, m_pos, (size_t)(m_end - m_pos));
         if (decode_len == 0)
             return false;
         m_pos += decode_len;
-        if (str_len > (uint64_t)(m_end - m_pos))
+        if (str_len > load_remain() || !load_need((size_t)str_len))
             return false;
-        m_shared_string.push_back((char*)m_pos);
-        m_shared_strlen.push_back((size_t)str_len);
+        if (session_slot > 0) {
+            m_load_session[(size_t)session_slot - 1].assign((char*)m_pos, (size_t)str_len);
+        }
         lua_pushlstring(L, (char*)m_pos, (size_t)str_len);
+        if (m_load_anchor > 0) {
+            // 窗口中的数据之后会被覆盖,改为引用lua字符串本身,并放到锚表中防止被回收
+            m_shared_string.push_back(lua_tostring(L, -1));
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, m_load_anchor, (lua_Integer)m_shared_string.size());
+        } else {
+            m_shared_string.push_back((char*)m_pos);
+        }
+        m_shared_strlen.push_back((size_t)str_len);
         m_pos += str_len;
         break;
+    }
 
     case ar_type::string_idx:
+        load_peek(MAX_VARINT_SIZE);
         decode_len = decode_u64(&str_idx, m_pos, (size_t)(m_end - m_pos));
-        if (decode_len == 0 || str_idx >= m_shared_string.size())
+        if (decode_len == 0 || str_idx >= m_message_base + m_shared_string.size())
             return false;
         m_pos += decode_len;
+        if (str_idx < (uint64_t)m_message_base) {
+            const std::string& str = str_idx < (uint64_t)m_dict_base ? m_dict_strings[(size_t)str_idx] : m_load_session[(size_t)str_idx - m_dict_base];
+            lua_pushlstring(L, str.data(), str.size());
+            break;
+        }
+        str_idx -= m_message_base;
         lua_pushlstring(L, m_shared_string[(int)str_idx], m_shared_strlen[(int)str_idx]);
         break;
 
@@ -413,17 +1665,147 @@ bool lua_archiver::load_value(lua_State* L, bool can_be_nil) {
 }
 
 bool lua_archiver::load_table(lua_State* L) {
-    if (m_end - m_pos < (ptrdiff_t)sizeof(unsigned char))
+    if (!load_need(sizeof(unsigned char)))
+        return false;
+
+    unsigned char marker = *m_pos;
+    if (marker == table_ref) {
+        m_pos++;
+        uint64_t ref = 0;
+        load_peek(MAX_VARINT_SIZE);
+        size_t decode_len = decode_u64(&ref, m_pos, (size_t)(m_end - m_pos));
+        if (decode_len == 0 || m_load_refs == 0 || ref == 0 || ref > (uint64_t)m_load_table_count)
+            return false;
+        m_pos += decode_len;
+        lua_rawgeti(L, m_load_refs, (lua_Integer)ref);
+        return true;
+    }
+    if (marker < table_segment || marker > table_packed_bool)
+        return load_table_pairs(L);
+    m_pos++;
+
+    uint64_t narr = 0, nhash = 0;
+    load_peek(MAX_VARINT_SIZE * 2);
+    size_t decode_len = decode_u64(&narr, m_pos, (size_t)(m_end - m_pos));
+    if (decode_len == 0)
+        return false;
+    m_pos += decode_len;
+    decode_len = decode_u64(&nhash, m_pos, (size_t)(m_end - m_pos));
+    if (decode_len == 0)
         return false;
+    m_pos += decode_len;
+
+    // 每个值至少一个字节(位图为1/8字节),数据不可信时以此限制预留的大小
+    uint64_t rest_len = load_remain();
+    uint64_t arr_len = narr;
+    if (marker == table_packed_bool) {
+        arr_len = (narr + 7) / 8;
+    } else if (marker == table_packed_double && narr <= rest_len) {
+        arr_len = narr * sizeof(uint64_t);
+    }
+    if (arr_len > rest_len || nhash > (rest_len - arr_len) / 2)
+        return false;
+
+    int narr_i = (int)narr;
+    if (m_max_arr_reserve >= 0) {
+        if (narr_i > m_arr_reserve) {
+            narr_i = m_arr_reserve;
+        }
+        m_arr_reserve -= narr_i;
+    }
+
+    int nhash_i = (int)nhash;
+    if (m_max_hash_reserve >= 0) {
+        if (nhash_i > m_hash_reserve) {
+            nhash_i = m_hash_reserve;
+        }
+        m_hash_reserve -= nhash_i;
+    }
+
+    lua_createtable(L, narr_i, nhash_i);
+    if (m_load_refs != 0) {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, m_load_refs, ++m_load_table_count);
+    }
+    if (marker != table_segment) {
+        if (!load_packed(L, narr, marker))
+            return false;
+    } else {
+        for (uint64_t i = 1; i <= narr; i++) {
+            if (!load_value(L))
+                return false;
+            lua_rawseti(L, -2, (lua_Integer)i);
+        }
+    }
+    for (uint64_t i = 0; i < nhash; i++) {
+        if (!load_value(L, false) || !load_value(L))
+            return false;
+        lua_rawset(L, -3);
+    }
+    return true;
+}
+
+bool lua_archiver::load_packed(lua_State* L, uint64_t narr, unsigned char marker) {
+    uint64_t values[pack_chunk];
+    uint64_t prev = 0;
+    for (uint64_t first = 1; first <= narr; first += pack_chunk) {
+        int count = (int)std::min((uint64_t)pack_chunk, narr - first + 1);
+        if (marker == table_packed_int) {
+            // 分段解压时这一块可能跨过窗口的末尾,批量解码失败就逐个解码
+            size_t batch_len = decode_u64_batch(values, (size_t)count, m_pos, (size_t)(m_end - m_pos));
+            m_pos += batch_len;
+            for (int i = 0; i < count && batch_len == 0; i++) {
+                load_peek(MAX_VARINT_SIZE);
+                size_t decode_len = decode_u64(&values[i], m_pos, (size_t)(m_end - m_pos));
+                if (decode_len == 0)
+                    return false;
+                m_pos += decode_len;
+            }
+            zigzag_prefix_sum(values, count, prev);
+            prev = values[count - 1];
+            for (int i = 0; i < count; i++) {
+                lua_pushinteger(L, (lua_Integer)values[i]);
+                lua_rawseti(L, -2, (lua_Integer)(first + i));
+            }
+        } else if (marker == table_packed_double) {
+            if (!load_need((size_t)count * sizeof(uint64_t)))
+                return false;
+            memcpy(values, m_pos, (size_t)count * sizeof(uint64_t));
+            m_pos += (size_t)count * sizeof(uint64_t);
+            for (int i = 0; i < count; i++) {
+                values[i] = letohll(values[i]);
+            }
+            for (int i = 0; i < count; i++) {
+                double v;
+                memcpy(&v, &values[i], sizeof(v));
+                lua_pushnumber(L, (lua_Number)v);
+                lua_rawseti(L, -2, (lua_Integer)(first + i));
+            }
+        } else {
+            if (!load_need((size_t)(count + 7) / 8))
+                return false;
+            unpack_bits(m_pos, count, values);
+            m_pos += (count + 7) / 8;
+            for (int i = 0; i < count; i++) {
+                lua_pushboolean(L, (int)values[i]);
+                lua_rawseti(L, -2, (lua_Integer)(first + i));
+            }
+        }
+    }
+    return true;
+}
 
+// 旧格式: table_head + lhsize + narr + (k,v)... + table_tail
+bool lua_archiver::load_table_pairs(lua_State* L) {
     unsigned char lhsize = *m_pos++;
     uint64_t narr = 0;
+    load_peek(MAX_VARINT_SIZE);
     size_t decode_len = decode_u64(&narr, m_pos, (size_t)(m_end - m_pos));
     if (decode_len == 0)
         return false;
     m_pos += decode_len;
 
-    uint64_t rest_len = (uint64_t)(m_end - m_pos);
+    uint64_t rest_len = load_remain();
     if (rest_len < 1)
         return false;
 
@@ -452,7 +1834,7 @@ bool lua_archiver::load_table(lua_State* L) {
     }
     
     lua_createtable(L, narr_i, hsize_i);
-    while (m_pos < m_end) {
+    while (load_need(sizeof(unsigned char))) {
         if (*m_pos == (unsigned char)ar_type::table_tail) {
             m_pos++;
             return true;
@@ -5,7 +5,35 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
+#include "lz4.h"
+#ifdef _MSC_VER
+struct iovec {
+    void* iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+class lz_worker_pool;
+
+struct lua_archiver_stats {
+    uint64_t compress_count = 0;   // 压缩的次数
+    uint64_t compress_skip = 0;    // 采样判断为不可压缩而跳过的次数
+    uint64_t compress_in = 0;      // 压缩前的字节数
+    uint64_t compress_out = 0;     // 压缩后的字节数
+    uint64_t compress_ns = 0;      // 压缩(包括采样)耗时,纳秒
+    uint64_t decompress_count = 0;
+    uint64_t decompress_in = 0;
+    uint64_t decompress_out = 0;
+    uint64_t decompress_ns = 0;
+};
 
 class lua_archiver {
 public:
@@ -14,41 +42,212 @@ public:
     virtual ~lua_archiver();
 
     void set_buffer_size(size_t size);
+    // 缓冲区可以增长到的上限,大于缓冲区初始大小时,save/load在空间不足时按倍数扩大缓冲区,直到这个上限
+    // 连续若干次save/load的数据都不超过初始大小时,扩大后的缓冲区才恢复为初始大小; 0表示不增长(默认),超出缓冲区大小即失败
+    void set_max_buffer_size(size_t size) { m_max_buffer_size = size; }
     void set_lz_threshold(size_t size) { m_lz_threshold = size; }
+    // LZ4的加速参数,越大压缩越快,压缩率越低,默认为1
+    void set_lz_acceleration(int acceleration) { m_lz_acceleration = acceleration; }
+    // 较大的数据压缩前先取几段试压缩,预计压缩率(压缩前/压缩后)低于ratio时不压缩,默认1.1; 0表示不采样
+    void set_lz_min_ratio(double ratio) { m_lz_min_ratio = ratio; }
+    // 超过block_size的数据分成独立的块,用threads个线程(包括调用线程)并行压缩,数据头部带有块索引
+    // load端用自己设置的threads并行解压(block_size在load时不起作用); block_size为0时关闭(默认)
+    void set_lz_block(size_t block_size, int threads);
+    // 分块压缩的数据load时边解压边解码,只占用大约两个块大小的窗口,不再需要容纳整个数据的解压缓冲区
+    // 原始长度和块大小仍不能超过缓冲区的上限(见set_max_buffer_size),上限只用于检查,不会按它分配内存
+    void set_streaming_load(bool enable) { m_streaming_load = enable; }
+    const lua_archiver_stats& get_stats() const { return m_stats; }
+    void reset_stats() { m_stats = lua_archiver_stats(); }
     void set_max_array_reserve(int size) { m_max_arr_reserve = size; }
     void set_max_hash_reserve(int size) { m_max_hash_reserve = size; }
+    // save时可以共享的字符串个数上限,重复出现的字符串只写一次,之后用序号引用
+    void set_max_shared_string(int count);
+    // 读写双方事先约定的静态字典(如常用的key),字典中的字符串只写其序号,id(版本号)记录在数据头部
+    // load时数据中的字典id必须与本地设置的一致; strings为空时取消字典
+    void set_dictionary(int id, const std::vector<std::string>& strings);
+    // 会话模式: 共享字符串表在多次save之间保留,只适用于按顺序送达的单条连接(load端自动跟随)
+    // 最多保留max_strings个长度不超过max_len的字符串,满了按LRU淘汰,淘汰在数据中标明; max_strings为0时关闭
+    void set_session(int max_strings, size_t max_len = 64);
+    // 清空会话表,并通知load端在收到下一条消息时同时清空; 一方save/load失败后,双方都要reset
+    void reset_session();
+    // LZ4流模式: 连续的消息共用压缩历史(64KB窗口),小消息也能有不错的压缩率,开启后每条消息都会压缩
+    // 与会话模式一样只适用于按顺序送达的单条连接,load端自动跟随
+    void set_lz_stream(bool enable);
+    // 流模式预先装入的字典(只用最后64KB),读写双方必须一致,在下一次reset时生效
+    void set_lz_dictionary(const std::string& dict) { m_lz_dict = dict; }
+    void reset_lz_stream() { m_lz_stream_reset = true; }
+    // iovec方式save时,长度不小于此值的字符串直接引用lua字符串本身,不拷贝
+    void set_iov_threshold(size_t size) { m_iov_threshold = size; }
+    // 引用模式: 同一个table在一次save中多次出现时只写一次,之后写它的序号,load时还原为同一个table
+    // 有环的table也可以save; 默认关闭(按值展开,多次出现就写多份),load端自动跟随
+    void set_table_ref(bool enable) { m_table_ref = enable; }
 
     void* save(size_t* data_len, lua_State* L, int first, int last);
+    // 直接写入调用者提供的缓冲区,返回写入的字节数,空间不足或失败时返回0
+    size_t save(void* buffer, size_t buffer_size, lua_State* L, int first, int last);
+    // 追加到sink末尾(按需扩大),返回追加的字节数,失败时返回0且sink保持不变; 追加的数据同样受缓冲区上限的限制
+    size_t save(std::string* sink, lua_State* L, int first, int last);
+    // 结果以iovec数组给出,可直接用于writev,返回总字节数,失败返回0
+    // 大字符串直接引用lua中的字符串,所以在写出之前,[first, last]上的值(包括其中的table)不能被修改
+    // 下一次save之前有效
+    size_t save(std::vector<iovec>* iov, lua_State* L, int first, int last);
     int load(lua_State* L, const void* data, size_t data_len);
 
 private:
+    void* save_data(size_t* data_len, lua_State* L, int first, int last);
+    size_t save_data(void* buffer, size_t buffer_size, lua_State* L, int first, int last);
+    size_t save_data(std::string* sink, lua_State* L, int first, int last);
+    size_t save_data(std::vector<iovec>* iov, lua_State* L, int first, int last);
+    bool save_header();
+    size_t encode_header(unsigned char* buffer, unsigned char flags, bool lz4, size_t raw_len);
+    bool load_header();
+    bool save_values(unsigned char* buffer, size_t buffer_size, lua_State* L, int first, int last);
+    size_t compress();
+    bool probe_compressible(const char* src, int src_len);
+    int compress_stream(const char* src, char* dst, int src_len, int dst_capacity);
+    size_t compress_blocks(const char* src, int src_len, unsigned char flags);
+    bool decompress_blocks(const char* src, int src_len);
+    void run_blocks(int count, const std::function<void(int, int)>& job);
+    bool decompress(const char* src, int src_len);
+    bool decompress_stream(const char* src, int src_len);
+    bool need_compress(size_t len) const { return m_lz_stream != nullptr || len >= m_lz_threshold; }
+    int load_data(lua_State* L, const void* data, size_t data_len);
     bool alloc_buffer();
     void free_buffer();
+    void shrink_buffer(bool shrink_ar);
+    void note_data_size(size_t size);
+    bool reserve(size_t size) { return m_end - m_pos >= (ptrdiff_t)size || grow_buffer(size); }
+    bool grow_buffer(size_t size);
+    bool grow_lz_buffer(size_t size);
+    bool grow_sink(size_t size);
+    bool save_u64(uint64_t v);
+    bool save_s64(int64_t v);
     bool save_value(lua_State* L, int idx);
     bool save_number(double v);
     bool save_integer(int64_t v);
     bool save_bool(bool v);
     bool save_nil();
     bool save_table(lua_State* L, int idx);
+    bool save_array(lua_State* L, int idx, lua_Integer narr, size_t marker_pos);
+    int save_packed(lua_State* L, int idx, lua_Integer narr, unsigned char marker);
+    bool save_count(size_t pos, uint64_t count);
     bool save_string(lua_State* L, int idx);
-    int find_shared_str(const char* str);
+    void reset_shared_str();
+    int intern_shared_str(const char* str, size_t len);
+    int find_dict_str(const char* str, size_t len);
+    int find_session_str(const char* str, size_t len);
+    void link_session_slot(int slot);
+    void unlink_session_slot(int slot);
+    // 保证[m_pos, m_end)中至少有size字节,分段解压时不够就继续解压,数据总共不足size字节时返回false
+    bool load_need(size_t size) { return m_end - m_pos >= (ptrdiff_t)size || load_refill(size); }
+    // 尽量准备好size字节(用于varint等长度不定的数据),之后仍以m_end为界
+    void load_peek(size_t size) { if (m_end - m_pos < (ptrdiff_t)size) load_refill(size); }
+    bool load_refill(size_t size);
+    uint64_t load_remain() const { return (uint64_t)(m_end - m_pos) + m_load_pending; }
     bool load_value(lua_State* L, bool can_be_nil = true);
     bool load_table(lua_State* L);
+    bool load_packed(lua_State* L, uint64_t narr, unsigned char marker);
+    bool load_table_pairs(lua_State* L);
 
 private:
     unsigned char* m_begin = nullptr;
     unsigned char* m_pos = nullptr;
     unsigned char* m_end = nullptr;
     int m_table_depth = 0;
+    bool m_table_ref = false;
+    std::unordered_map<const void*, int> m_table_refs; // save端: table -> 序号(从1开始)
+    int m_load_refs = 0; // load端按出现顺序记录table的表在栈上的位置
+    int m_load_table_count = 0;
     std::vector<const char*> m_shared_string;
     std::vector<size_t> m_shared_strlen;
+    // save用的共享字符串表: 以字符串指针为key的开放寻址哈希表,通过m_shared_gen区分各次save,不必每次清空
+    struct shared_slot {
+        const char* str;
+        uint32_t gen;
+        int idx;
+    };
+    std::vector<shared_slot> m_shared_slots;
+    uint32_t m_shared_gen = 0;
+    int m_shared_bits = 0;
+    int m_shared_count = 0;
+    int m_shared_used = 0;
+    int m_max_shared_string = 4096;
+    // 字典中的字符串占用序号[0, m_dict_base),本次save(load)中共享的字符串序号从m_dict_base开始
+    int m_dict_id = 0;
+    int m_dict_base = 0;
+    size_t m_dict_max_len = 0;
+    std::vector<std::string> m_dict_strings;
+    std::unordered_map<std::string_view, int> m_dict_index;
+    size_t m_header_len = 1;
+    // 会话字符串表占用序号[m_dict_base, m_message_base),本次消息中共享的字符串序号从m_message_base开始
+    struct session_slot {
+        std::string str;
+        int prev;
+        int next;
+        uint32_t gen; // 最后一次被使用时的m_session_gen,本次save用到的不能淘汰
+    };
+    std::vector<session_slot> m_session_slots;
+    std::unordered_map<std::string_view, int> m_session_index;
+    int m_session_fill = 0;
+    int m_session_head = -1; // 最近使用的
+    int m_session_tail = -1;
+    int m_session_define = -1; // 正在save的字符串新占用的槽位
+    uint32_t m_session_gen = 0;
+    size_t m_session_max_len = 0;
+    bool m_session_reset = false;
+    std::vector<std::string> m_load_session; // load端的会话表
+    bool m_load_in_session = false;
+    int m_message_base = 0;
+    unsigned char m_header_flags = 0;
+    // LZ4流模式,消息的原始数据拷贝到history中依次相接,以便后面的消息引用
+    LZ4_stream_t* m_lz_stream = nullptr;
+    bool m_lz_stream_reset = false;
+    std::string m_lz_dict;
+    std::vector<char> m_lz_history;
+    size_t m_lz_history_len = 0;
+    LZ4_streamDecode_t* m_lz_stream_decode = nullptr; // load端
+    std::vector<char> m_lz_load_history;
+    size_t m_lz_load_history_len = 0;
+    size_t m_lz_raw_len = 0;
     unsigned char* m_ar_buffer = nullptr;
     unsigned char* m_lz_buffer = nullptr;
     size_t m_ar_buffer_size = 0;
     size_t m_lz_buffer_size = 0;
+    size_t m_max_buffer_size = 0;
+    int m_small_count = 0; // 连续不超过初始大小的save/load次数
+    size_t m_ar_capacity = 0;
+    size_t m_lz_capacity = 0;
     size_t m_lz_threshold = 0;
+    int m_lz_acceleration = 1;
+    double m_lz_min_ratio = 1.1;
+    LZ4_stream_t* m_lz_state = nullptr; // 非流模式压缩用的状态,避免每次在栈上分配
+    size_t m_lz_block_size = 0;
+    int m_lz_threads = 1;
+    lz_worker_pool* m_lz_pool = nullptr;
+    std::vector<LZ4_stream_t> m_lz_block_states; // 每个线程一个
+    std::vector<int> m_lz_block_lens; // 各块压缩后的长度
+    size_t m_load_block_size = 0;
+    unsigned char m_load_flags = 0;
+    // 分段解压load
+    bool m_streaming_load = false;
+    std::vector<unsigned char> m_load_window;
+    const char* m_load_src = nullptr; // 下一个待解压的块
+    size_t m_load_block_next = 0;
+    uint64_t m_load_pending = 0; // 还没有解压的字节数
+    int m_load_anchor = 0; // 锚表在栈上的位置,分段解压时用来保证共享字符串不被回收
+    lua_archiver_stats m_stats;
     int m_max_arr_reserve = 1024;
     int m_max_hash_reserve = 4096;
     int m_arr_reserve = 0;
     int m_hash_reserve = 0;
+    std::string* m_sink = nullptr;
+    size_t m_sink_base = 0;
+    size_t m_iov_threshold = 1024;
+    bool m_iov_mode = false;
+    struct iov_ref {
+        size_t offset; // 引用出现在m_ar_buffer中的位置
+        const char* str;
+        size_t len;
+    };
+    std::vector<iov_ref> m_iov_refs;
 };
@@ -10,43 +10,156 @@
 #endif
 #include <stdio.h>
 #include <signal.h>
+#ifndef _MSC_VER
+#include <sys/time.h>
+#include <unistd.h>
+#endif
 #include <map>
 #include <string>
 #include <algorithm>
+#include <new>
+#include <chrono>
+#include <vector>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#endif
 #include "luna.h"
+#include "luna_trace.h"
+#include "luna_alloc.h"
+
+#ifdef LUNA_STACK_TRACE_ON
+thread_local lua_stack_trace_ring g_lua_stack_trace;
+#if defined(__GNUC__) && !defined(_WIN32)
+thread_local lua_stack_trace_ring* g_lua_stack_trace_crash __attribute__((tls_model("initial-exec"))) = nullptr;
+#else
+thread_local lua_stack_trace_ring* g_lua_stack_trace_crash = nullptr;
+#endif
+
+static const char* s_stack_trace_types[] = { "none", "nil", "boolean", "lightuserdata", "number", "string", "table", "function", "userdata", "thread" };
+
+static char* lua_stack_trace_append(char* pos, char* end, const char* text) {
+    while (*text && pos < end) {
+        *pos++ = *text++;
+    }
+    return pos;
+}
+
+static char* lua_stack_trace_append(char* pos, char* end, int value) {
+    char digits[16];
+    int n = 0;
+    unsigned int v = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    if (value < 0 && pos < end) {
+        *pos++ = '-';
+    }
+    while (n > 0 && pos < end) {
+        *pos++ = digits[--n];
+    }
+    return pos;
+}
+
+// 格式: [site:line] top=3: table string nil
+static size_t lua_stack_trace_format(const lua_stack_trace_entry& entry, char* buffer, size_t size) {
+    char* pos = buffer;
+    char* end = buffer + size - 1;
+    pos = lua_stack_trace_append(pos, end, "[");
+    pos = lua_stack_trace_append(pos, end, entry.site ? entry.site : "?");
+    pos = lua_stack_trace_append(pos, end, ":");
+    pos = lua_stack_trace_append(pos, end, entry.line);
+    pos = lua_stack_trace_append(pos, end, "] top=");
+    pos = lua_stack_trace_append(pos, end, entry.top);
+    pos = lua_stack_trace_append(pos, end, ":");
+    for (int i = 0; i < LUA_STACK_TRACE_TYPES && entry.types[i] != LUA_TNONE; i++) {
+        int type = entry.types[i];
+        pos = lua_stack_trace_append(pos, end, " ");
+        pos = lua_stack_trace_append(pos, end, type >= 0 && type <= LUA_TTHREAD ? s_stack_trace_types[type + 1] : "?");
+    }
+    *pos++ = '\n';
+    return (size_t)(pos - buffer);
+}
+
+template <typename F>
+static void lua_stack_trace_foreach(const lua_stack_trace_ring& ring, F&& func) {
+    uint32_t count = ring.count;
+    uint32_t first = count > (uint32_t)LUA_STACK_TRACE_SIZE ? count - LUA_STACK_TRACE_SIZE : 0;
+    char buffer[256];
+    for (uint32_t i = first; i != count; i++) {
+        size_t len = lua_stack_trace_format(ring.entries[i % LUA_STACK_TRACE_SIZE], buffer, sizeof(buffer));
+        func(buffer, len);
+    }
+}
+
+std::string lua_stack_trace_text() {
+    std::string text;
+    lua_stack_trace_foreach(g_lua_stack_trace, [&](const char* line, size_t len) { text.append(line, len); });
+    return text;
+}
 
-void stackDump(lua_State* L, int line, const char* filename) {
-#ifdef DEBUG
-    int top = lua_gettop(L);
-    printf("[%s:%d]stack begin, total[%d]\n", filename, line, top);
-
-    for (int i = 1; i <= top; i++) {
-        int type = lua_type(L, i);
-        switch (type) {
-            case LUA_TSTRING:
-                printf("'%s'", lua_tostring(L, i));
-                break;
-            case LUA_TBOOLEAN:
-                printf(lua_toboolean(L, i) ? "true" : "false");
-                break;
-            case LUA_TNUMBER:
-                printf("%g", lua_tonumber(L, i));
-                break;
-            default:
-                printf("%s", lua_typename(L, type));
-                break;
-        }
-        printf("\t");
-    }
-    printf("\n");
-
-    printf("[%s:%d]stack end\n", filename, line);
+#ifndef _MSC_VER
+static void lua_stack_trace_write(int fd, const lua_stack_trace_ring& ring) {
+    lua_stack_trace_foreach(ring, [=](const char* line, size_t len) {
+        ssize_t ret = write(fd, line, len);
+        (void)ret;
+    });
+}
+#endif
+
+void lua_stack_trace_dump(int fd) {
+#ifndef _MSC_VER
+    lua_stack_trace_write(fd, g_lua_stack_trace);
+#else
+    FILE* file = fd == 2 ? stderr : stdout;
+    lua_stack_trace_foreach(g_lua_stack_trace, [=](const char* line, size_t len) { fwrite(line, 1, len, file); });
+#endif
+}
+
+#ifndef _MSC_VER
+// 信号处理函数中只读g_lua_stack_trace_crash,输出只用write
+static void lua_stack_trace_crash(int sig) {
+    static const char s_title[] = "luna stack trace:\n";
+    static const char s_empty[] = "(no stack trace on this thread)\n";
+    ssize_t ret = write(2, s_title, sizeof(s_title) - 1);
+    const lua_stack_trace_ring* ring = g_lua_stack_trace_crash;
+    if (ring != nullptr) {
+        lua_stack_trace_write(2, *ring);
+    } else {
+        ret = write(2, s_empty, sizeof(s_empty) - 1);
+    }
+    (void)ret;
+    // SA_RESETHAND已恢复默认处理
+    raise(sig);
+}
+#endif
+
+void lua_stack_trace_install_crash_handler() {
+#ifndef _MSC_VER
+    g_lua_stack_trace_crash = &g_lua_stack_trace;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = lua_stack_trace_crash;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    for (int sig : { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT }) {
+        sigaction(sig, &action, nullptr);
+    }
 #endif
 }
+#else
+std::string lua_stack_trace_text() { return std::string(); }
+void lua_stack_trace_dump(int fd) {}
+void lua_stack_trace_install_crash_handler() {}
+#endif
 
 struct luna_function_wapper final {
-    luna_function_wapper(const lua_global_function& func) : m_func(func) {}
+    luna_function_wapper(const lua_global_function& func, const char* name) : m_func(func), m_name(name ? name : "?") {}
     lua_global_function m_func;
+    std::string m_name;
     DECLARE_LUA_CLASS(luna_function_wapper);
 };
 
@@ -56,21 +169,38 @@ LUA_EXPORT_CLASS_END()
 static int lua_global_bridge(lua_State* L) {
     //强制类型转换
     auto* wapper  = lua_to_object<luna_function_wapper*>(L, lua_upvalueindex(1));
+    auto* rt = (luna_runtime*)lua_touserdata(L, lua_upvalueindex(2));
+    LUNA_STAT(rt, global_bridge);
     if (wapper != nullptr) {
         //全局函数调用
-        return wapper->m_func(L);
+        bool trace = luna_trace_enabled();
+        if (rt->profiler == nullptr && !trace)
+            return wapper->m_func(L);
+
+        // trace和profile可以同时打开,两边都要记录
+        uint64_t start = trace ? luna_trace_now() : 0;
+        uint64_t tick = luna_tick();
+        int ret = wapper->m_func(L);
+        if (rt->profiler != nullptr) {
+            _lua_profile_add(rt, nullptr, 0, wapper->m_name.c_str(), luna_tick() - tick);
+        }
+        if (trace) {
+            luna_trace_complete("bridge", wapper->m_name.c_str(), start);
+        }
+        return ret;
     }
     return 0;
 }
 
-void lua_push_function(lua_State* L, lua_global_function func) {
+void lua_push_function(lua_State* L, lua_global_function func, const char* name) {
     stackDump(L, __LINE__, __FUNCTION__);
     //LUA_REGISTRYINDEX.__objects__.obj (table)
-    lua_push_object(L, new luna_function_wapper(func));
+    lua_push_object(L, new luna_function_wapper(func, name));
     stackDump(L, __LINE__, __FUNCTION__);
 
-    //lua_global_bridge,
-    lua_pushcclosure(L, lua_global_bridge, 1); //有一个参数
+    //lua_global_bridge(wapper, runtime)
+    lua_pushlightuserdata(L, lua_get_runtime(L));
+    lua_pushcclosure(L, lua_global_bridge, 2);
     stackDump(L, __LINE__, __FUNCTION__);
 }
 
@@ -78,14 +208,48 @@ int _lua_object_bridge(lua_State* L) {
     stackDump(L, __LINE__, __FUNCTION__);
     void* obj = lua_touserdata(L, lua_upvalueindex(1));
     lua_object_function* func = (lua_object_function*)lua_touserdata(L, lua_upvalueindex(2));
+    LUNA_STAT(lua_get_runtime(L), object_bridge);
     stackDump(L, __LINE__, __FUNCTION__);
     if (obj != nullptr && func != nullptr) {
         stackDump(L, __LINE__, __FUNCTION__);
+        if (luna_trace_enabled()) {
+            // 成员函数名取自调用方
+            lua_Debug ar;
+            const char* name = "?";
+            if (lua_getstack(L, 0, &ar) && lua_getinfo(L, "n", &ar) && ar.name != nullptr) {
+                name = ar.name;
+            }
+            uint64_t start = luna_trace_now();
+            int ret = (*func)(obj, L);
+            luna_trace_complete("bridge", name, start);
+            return ret;
+        }
         return (*func)(obj, L);
     }
     return 0;
 }
 
+// upvalue: obj, adapter, runtime, name, meta_name
+static int lua_object_profile_bridge(lua_State* L) {
+    auto rt = (luna_runtime*)lua_touserdata(L, lua_upvalueindex(3));
+    uint64_t tick = luna_tick();
+    int ret = _lua_object_bridge(L);
+    _lua_profile_add(rt, (const char*)lua_touserdata(L, lua_upvalueindex(5)), ':', lua_tostring(L, lua_upvalueindex(4)), luna_tick() - tick);
+    return ret;
+}
+
+void _lua_push_object_bridge(lua_State* L, void* obj, lua_object_function* func, const char* meta_name) {
+    //tObj, key
+    //在lua_member_index中执行,upvalue 1即runtime
+    luna_runtime* rt = lua_upvalue_runtime(L);
+    lua_pushlightuserdata(L, obj);
+    lua_pushlightuserdata(L, func);
+    lua_pushlightuserdata(L, rt);
+    lua_pushvalue(L, 2);
+    lua_pushlightuserdata(L, (void*)meta_name);
+    lua_pushcclosure(L, lua_object_profile_bridge, 5);
+}
+
 bool lua_get_table_function(lua_State* L, const char table[], const char function[]) {
     lua_getglobal(L, table);
     if (!lua_istable(L, -1))
@@ -95,12 +259,185 @@ bool lua_get_table_function(lua_State* L, const char table[], const char functio
     return lua_isfunction(L, -1);
 }
 
+// 设置了预算的lua_State数量,为0时lua_call_function不必查询runtime
+static std::atomic<int> s_budget_states(0);
+static const int s_budget_step = 1000;
+
+struct luna_budget {
+    lua_State* L = nullptr;        // hook所在的lua线程
+    int64_t instructions_left = 0; // 不限制时为INT64_MAX
+    int64_t instructions_start = 0;
+    uint64_t deadline_ns = 0;      // 0表示不限制
+    int step = 0;
+    bool yield = false;
+    bool exhausted = false;
+    lua_Hook old_hook = nullptr;
+    int old_mask = 0;
+    int old_count = 0;
+    int old_left = 0; // 距离下一次转调原hook还有多少条指令
+    luna_budget* prev = nullptr;
+};
+
+static uint64_t luna_steady_ns();
+
+// 嵌套调用时rt->budget是最内层的预算,不一定属于这个lua线程
+static luna_budget* lua_find_budget(lua_State* L) {
+    luna_budget* budget = lua_get_runtime(L)->budget;
+    while (budget != nullptr && budget->L != L) {
+        budget = budget->prev;
+    }
+    return budget;
+}
+
+static void lua_budget_hook(lua_State* L, lua_Debug* ar);
+
+// 扣除instructions条指令,预算用完时让出或者抛出错误
+static void lua_budget_charge(lua_State* L, luna_budget* budget, int64_t instructions) {
+    budget->instructions_left -= instructions;
+    if (!budget->exhausted) {
+        budget->exhausted = budget->instructions_left <= 0 || (budget->deadline_ns > 0 && luna_steady_ns() >= budget->deadline_ns);
+        if (!budget->exhausted)
+            return;
+    }
+
+    if (budget->yield && lua_isyieldable(L)) {
+        lua_yield(L, 0);
+        return;
+    }
+    // 之后每条指令都检查: 脚本中的pcall捕获了错误,也会在下一条指令再次抛出
+    budget->step = 1;
+    lua_sethook(L, lua_budget_hook, LUA_MASKCOUNT, 1);
+    lua_pushstring(L, LUNA_CALL_TIMEOUT);
+    lua_error(L);
+}
+
+// 外层预算的hook不转调,内层预算的额度已截断到外层剩余的额度,离开时再记到外层
+static bool lua_budget_chained(luna_budget* budget) {
+    return budget->old_hook != nullptr && budget->old_hook != lua_budget_hook && (budget->old_mask & LUA_MASKCOUNT) && budget->old_count > 0;
+}
+
+// 接管当前安装的hook,预算hook的间隔不超过它的count,以便按它自己的间隔转调
+static void lua_budget_save_hook(lua_State* L, luna_budget* budget) {
+    budget->old_hook = lua_gethook(L);
+    budget->old_mask = lua_gethookmask(L);
+    budget->old_count = lua_gethookcount(L);
+    budget->old_left = budget->old_count;
+    if (lua_budget_chained(budget)) {
+        budget->step = std::min(budget->step, budget->old_count);
+    }
+}
+
+static void lua_budget_hook(lua_State* L, lua_Debug* ar) {
+    luna_budget* budget = lua_find_budget(L);
+    if (budget == nullptr)
+        return;
+
+    if (lua_budget_chained(budget)) {
+        budget->old_left -= budget->step;
+        if (budget->old_left <= 0) {
+            budget->old_left += budget->old_count;
+            budget->old_hook(L, ar);
+            // 原hook可能换回了它自己保存的hook(例如堆采样的一次性hook),接管换回的hook,重新安装预算hook
+            if (lua_gethook(L) != lua_budget_hook) {
+                lua_budget_save_hook(L, budget);
+                lua_sethook(L, lua_budget_hook, LUA_MASKCOUNT, budget->step);
+            }
+        }
+    }
+    lua_budget_charge(L, budget, budget->step);
+}
+
+void _lua_budget_poll(lua_State* L) {
+    luna_budget* budget = lua_gethook(L) == lua_budget_hook ? lua_find_budget(L) : nullptr;
+    if (budget != nullptr) {
+        lua_budget_charge(L, budget, 1);
+    }
+}
+
+static void lua_budget_enter(lua_State* L, luna_runtime* rt, luna_budget* budget, uint64_t instructions, uint32_t timeout_ms) {
+    budget->L = L;
+    budget->instructions_left = instructions > 0 ? (int64_t)std::min<uint64_t>(instructions, INT64_MAX) : INT64_MAX;
+    budget->deadline_ns = timeout_ms > 0 ? luna_steady_ns() + (uint64_t)timeout_ms * 1000000 : 0;
+    // 嵌套调用(lua->C++->lua)不能超出外层预算剩余的额度
+    luna_budget* outer = rt->budget;
+    if (outer != nullptr) {
+        budget->instructions_left = std::min(budget->instructions_left, std::max<int64_t>(outer->instructions_left, 0));
+        if (outer->deadline_ns > 0 && (budget->deadline_ns == 0 || outer->deadline_ns < budget->deadline_ns)) {
+            budget->deadline_ns = outer->deadline_ns;
+        }
+    }
+    budget->instructions_start = budget->instructions_left;
+    budget->step = (int)std::min<int64_t>(std::max<int64_t>(budget->instructions_left, 1), s_budget_step);
+    lua_budget_save_hook(L, budget);
+    budget->prev = rt->budget;
+    rt->budget = budget;
+    lua_sethook(L, lua_budget_hook, LUA_MASKCOUNT, budget->step);
+}
+
+static void lua_budget_leave(lua_State* L, luna_runtime* rt, luna_budget* budget) {
+    rt->budget = budget->prev;
+    if (lua_gethook(L) == lua_budget_hook) {
+        lua_sethook(L, budget->old_hook, budget->old_mask, budget->old_count);
+    } else if (!_luna_heap_replace_hook(L, lua_budget_hook, budget->old_hook, budget->old_mask, budget->old_count)) {
+        // 调用期间装上了新的hook(例如luna.sampler_start),保留它; 它替换掉的如果是外层预算的hook,交给外层预算转调
+        luna_budget* owner = lua_find_budget(L);
+        if (owner != nullptr && budget->old_hook == lua_budget_hook) {
+            lua_budget_save_hook(L, owner);
+            lua_sethook(L, lua_budget_hook, LUA_MASKCOUNT, owner->step);
+        }
+    }
+    luna_budget* outer = budget->prev;
+    if (outer == nullptr)
+        return;
+
+    outer->instructions_left -= budget->instructions_start - budget->instructions_left;
+    // 重新设置hook会清零计数,同一线程上的外层预算在这里检查,用完时从下一条指令开始报错
+    if (!outer->exhausted && outer->L == L && budget->old_hook == lua_budget_hook) {
+        outer->exhausted = outer->instructions_left <= 0 || (outer->deadline_ns > 0 && luna_steady_ns() >= outer->deadline_ns);
+        if (outer->exhausted) {
+            outer->step = 1;
+            lua_sethook(L, lua_budget_hook, LUA_MASKCOUNT, 1);
+        }
+    }
+}
+
+void lua_set_call_budget(lua_State* L, uint64_t instructions, uint32_t timeout_ms) {
+    luna_runtime* rt = lua_get_runtime(L);
+    bool had_budget = rt->budget_instructions > 0 || rt->budget_timeout_ms > 0;
+    bool has_budget = instructions > 0 || timeout_ms > 0;
+    rt->budget_instructions = instructions;
+    rt->budget_timeout_ms = timeout_ms;
+    s_budget_states += (int)has_budget - (int)had_budget;
+    if (!has_budget) {
+        rt->call_timeout = false;
+    }
+}
+
+bool lua_call_timed_out(lua_State* L) {
+    return lua_get_runtime(L)->call_timeout;
+}
+
+int lua_resume_budget(lua_State* co, lua_State* from, int nargs, uint64_t instructions, uint32_t timeout_ms, bool* exhausted) {
+    luna_runtime* rt = lua_get_runtime(co);
+    luna_budget budget;
+    budget.yield = true;
+    lua_budget_enter(co, rt, &budget, instructions, timeout_ms);
+    int status = lua_resume(co, from, nargs);
+    lua_budget_leave(co, rt, &budget);
+    if (exhausted != nullptr) {
+        *exhausted = budget.exhausted && status == LUA_YIELD;
+    }
+    return status;
+}
+
 bool lua_call_function(lua_State* L, std::string* err, int arg_count, int ret_count) {
     //func, param1, parm2, parm3...
     stackDump(L, __LINE__, __FUNCTION__);
     int func_idx = lua_gettop(L) - arg_count;
-    if (func_idx <= 0 || !lua_isfunction(L, func_idx))
+    if (func_idx <= 0 || !lua_isfunction(L, func_idx)) {
+        LUNA_STAT(lua_get_runtime(L), call_error);
         return false;
+    }
 
     //func, param1, parm2, parm3..., debug
     lua_getglobal(L, "debug");
@@ -117,7 +454,36 @@ bool lua_call_function(lua_State* L, std::string* err, int arg_count, int ret_co
     //debug.traceback, func, param1, parm2, parm3...,
     lua_insert(L, func_idx);
     stackDump(L, __LINE__, __FUNCTION__);
-    if (lua_pcall(L, arg_count, ret_count, func_idx)) {
+    uint64_t trace_start = 0;
+    char trace_name[48];
+    if (luna_trace_enabled()) {
+        // 事件名为"函数名@源文件:行号"
+        lua_Debug ar;
+        lua_pushvalue(L, func_idx + 1);
+        lua_getinfo(L, ">S", &ar);
+        snprintf(trace_name, sizeof(trace_name), "lua_call@%s:%d", ar.short_src, ar.linedefined);
+        trace_start = luna_trace_now();
+    }
+    luna_runtime* rt = nullptr;
+    luna_budget budget;
+    if (s_budget_states > 0) {
+        rt = lua_get_runtime(L);
+        if (rt->budget_instructions > 0 || rt->budget_timeout_ms > 0) {
+            lua_budget_enter(L, rt, &budget, rt->budget_instructions, rt->budget_timeout_ms);
+        } else {
+            rt = nullptr;
+        }
+    }
+    int status = lua_pcall(L, arg_count, ret_count, func_idx);
+    if (rt != nullptr) {
+        lua_budget_leave(L, rt, &budget);
+        rt->call_timeout = budget.exhausted && status != LUA_OK;
+    }
+    if (trace_start != 0) {
+        luna_trace_complete("lua", trace_name, trace_start, "error", status != LUA_OK);
+    }
+    if (status != LUA_OK) {
+        LUNA_STAT(lua_get_runtime(L), call_error);
         if (err != nullptr) {
             *err = lua_tostring(L, -1);
         }
@@ -184,3 +550,807 @@ void _lua_del_fence(lua_State* L, const void* p) {
     lua_rawsetp(L, -2, p);   
     lua_pop(L, 1);  
 }
+
+void lua_slot_map::alloc(lua_object_handle* handle, void* obj) {
+    uint32_t slot = free_head;
+    if (slot != UINT32_MAX) {
+        free_head = slots[slot].next_free;
+    } else {
+        slot = (uint32_t)slots.size();
+        slots.emplace_back();
+    }
+    slots[slot].obj = obj;
+    handle->map = this;
+    handle->slot = slot;
+    handle->gen = slots[slot].gen;
+}
+
+void lua_slot_map::release(lua_object_handle* handle) {
+    node& n = slots[handle->slot];
+    n.obj = nullptr;
+    if (++n.gen == 0) {
+        n.gen = 1;
+    }
+    n.next_free = free_head;
+    free_head = handle->slot;
+    handle->map = nullptr;
+}
+
+static int lua_slot_map_gc(lua_State* L) {
+    auto map = (lua_slot_map*)lua_touserdata(L, 1);
+    if (map != nullptr) {
+        map->~lua_slot_map();
+    }
+    return 0;
+}
+
+void _lua_new_slot_map(lua_State* L) {
+    //slot_map
+    auto map = new (lua_newuserdata(L, sizeof(lua_slot_map))) lua_slot_map();
+    map->owner = lua_main_thread(L);
+
+    //slot_map, {__gc = lua_slot_map_gc}
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_slot_map_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+
+    //slot_map, shadows
+    //shadows = { slot + 1 = tObj, ... }, 值为弱引用
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    map->shadow_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+void _lua_del_handle(lua_State* L, lua_object_handle* handle) {
+    if (handle->map != nullptr) {
+        handle->map->release(handle);
+    }
+}
+
+void luna_runtime::add_bulk(bulk_release_func func, void* obj) {
+    if (bulk_list.empty() || bulk_list.back().first != func) {
+        auto it = std::find_if(bulk_list.begin(), bulk_list.end(), [func](auto& node) { return node.first == func; });
+        if (it == bulk_list.end()) {
+            bulk_list.emplace_back(func, std::vector<void*>());
+        } else {
+            // 把最近使用的类换到末尾,连续回收同类对象时无需查找
+            std::iter_swap(it, bulk_list.end() - 1);
+        }
+    }
+    bulk_list.back().second.push_back(obj);
+}
+
+static void lua_sampler_free(lua_State* L, luna_sampler* sampler);
+
+static int lua_runtime_gc(lua_State* L) {
+    auto rt = (luna_runtime*)lua_touserdata(L, 1);
+    if (rt != nullptr) {
+        // runtime先于所有影子对象被标记终结,所以它的__gc在这些对象之后执行
+        for (auto& node : rt->bulk_list) {
+            node.first(node.second.data(), node.second.size());
+        }
+        if (rt->sampler != nullptr) {
+            lua_sampler_free(L, rt->sampler);
+        }
+        rt->~luna_runtime();
+    }
+    return 0;
+}
+
+luna_runtime* lua_get_runtime(lua_State* L) {
+    //LUA_REGISTRYINDEX[runtime_key] or nil
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, lua_runtime_key()) == LUA_TUSERDATA) {
+        auto rt = (luna_runtime*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return rt;
+    }
+    lua_pop(L, 1);
+
+    //runtime, {__gc = lua_runtime_gc}
+    auto rt = new (lua_newuserdata(L, sizeof(luna_runtime))) luna_runtime();
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_runtime_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+
+    //LUA_REGISTRYINDEX[runtime_key] = runtime
+    lua_rawsetp(L, LUA_REGISTRYINDEX, lua_runtime_key());
+    return rt;
+}
+
+void _lua_new_shadow(lua_State* L) {
+    //meta, pool
+    luna_runtime* rt = lua_get_runtime(L);
+    if (rt->shadow_pool_max > 0) {
+        if (lua_rawgetp(L, -1, lua_shadow_pool_key()) == LUA_TTABLE) {
+            lua_Integer count = (lua_Integer)lua_rawlen(L, -1);
+            if (count > 0) {
+                //meta, pool, tObj
+                lua_rawgeti(L, -1, count);
+                lua_pushnil(L);
+                lua_rawseti(L, -3, count);
+                lua_remove(L, -2);
+
+                //被__gc过的表需要重新setmetatable,才会再次被标记为需要终结
+                lua_pushvalue(L, -2);
+                lua_setmetatable(L, -2);
+                rt->shadow_pool_size--;
+                rt->shadow_pool_hit++;
+                return;
+            }
+        }
+        lua_pop(L, 1);
+        rt->shadow_pool_miss++;
+    }
+    LUNA_STAT(rt, shadow_created);
+
+    //meta, tObj
+    lua_createtable(L, 0, 1);
+    lua_pushvalue(L, -2);
+    lua_setmetatable(L, -2);
+}
+
+void _lua_recycle_shadow(lua_State* L, int idx, luna_runtime* rt) {
+    idx = lua_normal_index(L, idx);
+    if (!lua_getmetatable(L, idx))
+        return;
+
+    //meta, pool
+    if (lua_rawgetp(L, -1, lua_shadow_pool_key()) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_createtable(L, rt->shadow_pool_max, 0);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, -3, lua_shadow_pool_key());
+    }
+
+    lua_Integer count = (lua_Integer)lua_rawlen(L, -1);
+    if (count < rt->shadow_pool_max) {
+        //清空影子表,保留其已分配的哈希部分
+        lua_pushnil(L);
+        while (lua_next(L, idx)) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, idx);
+        }
+        lua_pushvalue(L, idx);
+        lua_rawseti(L, -2, count + 1);
+        rt->shadow_pool_size++;
+    }
+    lua_pop(L, 2);
+}
+
+// 类名取自"_class_meta:"#ClassName
+static std::string_view lua_census_class_name(const char* meta_name) {
+    const char* class_name = strchr(meta_name, ':');
+    return class_name ? class_name + 1 : meta_name;
+}
+
+void _lua_census_add(lua_State* L, const char* meta_name, size_t size) {
+    luna_runtime* rt = lua_get_runtime(L);
+    std::string_view class_name = lua_census_class_name(meta_name);
+    auto it = rt->census.find(class_name);
+    if (it == rt->census.end()) {
+        it = rt->census.emplace(class_name, luna_census_record()).first;
+        it->second.name = class_name;
+        it->second.size = size;
+        it->second.alarm_at = rt->census_alarm_live;
+        // 换成指向节点内record.name的key,节点本身不会移动
+        auto node = rt->census.extract(it);
+        node.key() = node.mapped().name;
+        it = rt->census.insert(std::move(node)).position;
+    }
+
+    luna_census_record& record = it->second;
+    record.created++;
+    record.live++;
+    record.peak = std::max(record.peak, record.live);
+    if (record.alarm_at > 0 && record.live >= record.alarm_at) {
+        record.alarm_at *= 2;
+        if (rt->census_alarm) {
+            rt->census_alarm(L, record);
+        }
+    }
+}
+
+void _lua_census_remove(luna_runtime* rt, const char* meta_name, bool detached) {
+    auto it = rt->census.find(lua_census_class_name(meta_name));
+    if (it == rt->census.end() || it->second.live == 0)
+        return;
+
+    luna_census_record& record = it->second;
+    record.live--;
+    if (detached) {
+        record.detached++;
+    } else {
+        record.collected++;
+    }
+}
+
+void lua_get_census(lua_State* L, std::vector<luna_census_record>* records) {
+    records->clear();
+    for (auto& it : lua_get_runtime(L)->census) {
+        records->push_back(it.second);
+    }
+    std::sort(records->begin(), records->end(), [](auto& a, auto& b) { return a.live * a.size > b.live * b.size; });
+}
+
+void lua_set_census_alarm(lua_State* L, uint64_t live_limit, luna_census_alarm alarm) {
+    luna_runtime* rt = lua_get_runtime(L);
+    rt->census_alarm_live = live_limit;
+    rt->census_alarm = alarm;
+    for (auto& it : rt->census) {
+        luna_census_record& record = it.second;
+        record.alarm_at = live_limit;
+        // 已经超过阈值的类从下一个翻倍点开始告警
+        while (record.alarm_at > 0 && record.live >= record.alarm_at) {
+            record.alarm_at *= 2;
+        }
+    }
+}
+
+void lua_shutdown(lua_State* L) {
+    lua_get_runtime(L)->closing = true;
+    luna_close(L);
+}
+
+static uint64_t luna_steady_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t luna_tick() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_MSC_VER)
+    return __rdtsc();
+#else
+    return luna_steady_ns();
+#endif
+}
+
+static int luna_log2(uint64_t x) {
+#if defined(__GNUC__)
+    return x > 1 ? 63 - __builtin_clzll(x) : 0;
+#else
+    int n = 0;
+    while (x > 1) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+void _lua_profile_add(luna_runtime* rt, const char* meta_name, char sep, const char* name, uint64_t ticks) {
+    luna_profiler* profiler = rt->profiler;
+    if (profiler == nullptr)
+        return;
+
+    // 成员取值显示为"类名.成员名",成员函数调用显示为"类名:成员名", 类名取自"_class_meta:"#ClassName
+    std::string& key = profiler->key;
+    key.clear();
+    if (meta_name != nullptr) {
+        const char* class_name = strchr(meta_name, ':');
+        key = class_name ? class_name + 1 : meta_name;
+        key += sep;
+    }
+    key += name ? name : "?";
+
+    auto it = profiler->records.find(key);
+    if (it == profiler->records.end()) {
+        it = profiler->records.emplace(key, luna_profile_record()).first;
+        it->second.name = key;
+    }
+    luna_profile_record& record = it->second;
+
+    int bucket = luna_log2(ticks);
+    record.count++;
+    record.ticks += ticks;
+    record.max_ticks = std::max(record.max_ticks, ticks);
+    record.histogram[bucket]++;
+}
+
+void lua_profile_start(lua_State* L) {
+    luna_runtime* rt = lua_get_runtime(L);
+    if (rt->profiler == nullptr) {
+        rt->profile.start_tick = luna_tick();
+        rt->profile.start_ns = luna_steady_ns();
+        rt->profiler = &rt->profile;
+    }
+}
+
+void lua_profile_stop(lua_State* L) {
+    lua_get_runtime(L)->profiler = nullptr;
+}
+
+void lua_profile_reset(lua_State* L) {
+    luna_runtime* rt = lua_get_runtime(L);
+    rt->profile.records.clear();
+    rt->profile.start_tick = luna_tick();
+    rt->profile.start_ns = luna_steady_ns();
+}
+
+double lua_profile_report(lua_State* L, std::vector<luna_profile_record>* records) {
+    luna_profiler& profile = lua_get_runtime(L)->profile;
+    records->clear();
+    for (auto& it : profile.records) {
+        records->push_back(it.second);
+    }
+    std::sort(records->begin(), records->end(), [](auto& a, auto& b) { return a.ticks > b.ticks; });
+
+    // 用profiler开始以来的墙上时间校准tick
+    uint64_t ticks = luna_tick() - profile.start_tick;
+    uint64_t ns = luna_steady_ns() - profile.start_ns;
+    return (ticks > 0 && ns > 0) ? (double)ns / (double)ticks : 1.0;
+}
+
+// 每帧定长的名字缓冲,超长截断
+static const int s_sample_frame_size = 128;
+
+struct luna_sampler {
+    bool running = false;
+    bool use_sigprof = false;
+    int last_tick = 0;
+    int max_depth = 0;
+    size_t capacity = 0;
+    // 环形缓冲: 第i个样本的帧在frames[i * max_depth * s_sample_frame_size]开始,从叶子帧到根帧
+    std::vector<char> frames;
+    std::vector<int> depths;
+    std::vector<bool> truncated;
+    size_t head = 0;
+    size_t size = 0;
+    uint64_t samples = 0;
+    uint64_t overwritten = 0;
+    // 从环形缓冲汇总而来的folded stack
+    std::map<std::string, uint64_t> folded;
+};
+
+static volatile sig_atomic_t s_sigprof_tick = 0;
+// SIGPROF定时器和s_sigprof_tick是整个进程共用的,同一时间只能归一个sampler使用
+static std::atomic<luna_sampler*> s_sigprof_owner(nullptr);
+
+#ifndef _MSC_VER
+static void lua_sigprof_handler(int) {
+    s_sigprof_tick = (s_sigprof_tick + 1) & 0x7fffffff;
+}
+
+static void lua_set_sigprof(int usec) {
+    if (usec > 0) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = lua_sigprof_handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, nullptr);
+    }
+    struct itimerval timer;
+    timer.it_interval.tv_sec = usec / 1000000;
+    timer.it_interval.tv_usec = usec % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+#else
+static void lua_set_sigprof(int usec) {}
+#endif
+
+static void lua_release_sigprof(luna_sampler* sampler) {
+    luna_sampler* owner = sampler;
+    if (s_sigprof_owner.compare_exchange_strong(owner, nullptr)) {
+        lua_set_sigprof(0);
+    }
+}
+
+void _lua_sample_frame(lua_State* L, lua_Debug* ar, char* out, size_t size) {
+    const char* name = ar->name ? ar->name : "?";
+    lua_CFunction func = lua_tocfunction(L, -1);
+    if (func == lua_global_bridge) {
+        lua_getupvalue(L, -1, 1);
+        auto* wapper = lua_to_object<luna_function_wapper*>(L, -1);
+        snprintf(out, size, "%s [C++]", wapper ? wapper->m_name.c_str() : name);
+        lua_pop(L, 1);
+    } else if (func == _lua_object_bridge || func == lua_object_profile_bridge) {
+        snprintf(out, size, "%s [C++]", name);
+    } else if (func != nullptr) {
+        snprintf(out, size, "%s [C]", name);
+    } else if (ar->what[0] == 'm') {
+        snprintf(out, size, "main chunk@%s", ar->short_src);
+    } else {
+        snprintf(out, size, "%s@%s:%d", name, ar->short_src, ar->linedefined);
+    }
+    // ';'是folded格式的帧分隔符
+    for (char* c = out; *c; c++) {
+        if (*c == ';') *c = '_';
+    }
+}
+
+static void lua_sampler_hook(lua_State* L, lua_Debug* hook_ar) {
+    luna_sampler* sampler = lua_get_runtime(L)->sampler;
+    if (sampler == nullptr || !sampler->running)
+        return;
+
+    if (sampler->use_sigprof) {
+        int tick = s_sigprof_tick;
+        if (tick == sampler->last_tick)
+            return;
+        sampler->last_tick = tick;
+    }
+
+    size_t index = (sampler->head + sampler->size) % sampler->capacity;
+    if (sampler->size < sampler->capacity) {
+        sampler->size++;
+    } else {
+        sampler->head = (sampler->head + 1) % sampler->capacity;
+        sampler->overwritten++;
+    }
+
+    char* out = &sampler->frames[index * sampler->max_depth * s_sample_frame_size];
+    lua_Debug ar;
+    int depth = 0;
+    while (depth < sampler->max_depth && lua_getstack(L, depth, &ar)) {
+        lua_getinfo(L, "Snf", &ar);
+        _lua_sample_frame(L, &ar, out + depth * s_sample_frame_size, s_sample_frame_size);
+        lua_pop(L, 1);
+        depth++;
+    }
+    sampler->depths[index] = depth;
+    sampler->truncated[index] = depth == sampler->max_depth && lua_getstack(L, depth, &ar);
+    sampler->samples++;
+}
+
+// 把环形缓冲中的样本汇总到folded,在hook之外执行
+static void lua_sampler_flush(luna_sampler* sampler) {
+    std::string stack;
+    for (size_t i = 0; i < sampler->size; i++) {
+        size_t index = (sampler->head + i) % sampler->capacity;
+        const char* frames = &sampler->frames[index * sampler->max_depth * s_sample_frame_size];
+        stack = sampler->truncated[index] ? "[truncated]" : "";
+        for (int depth = sampler->depths[index] - 1; depth >= 0; depth--) {
+            if (!stack.empty()) stack += ';';
+            stack += frames + depth * s_sample_frame_size;
+        }
+        sampler->folded[stack]++;
+    }
+    sampler->head = 0;
+    sampler->size = 0;
+}
+
+bool lua_sampler_start(lua_State* L, int instruction_count, int sigprof_usec, int max_depth, int capacity) {
+    luna_runtime* rt = lua_get_runtime(L);
+    if (rt->sampler == nullptr) {
+        rt->sampler = new luna_sampler();
+    }
+
+    luna_sampler* sampler = rt->sampler;
+    bool use_sigprof = false;
+#ifndef _MSC_VER
+    use_sigprof = sigprof_usec > 0;
+#endif
+    if (use_sigprof) {
+        luna_sampler* owner = nullptr;
+        if (!s_sigprof_owner.compare_exchange_strong(owner, sampler) && owner != sampler)
+            return false;
+    } else if (sampler->running && sampler->use_sigprof) {
+        lua_release_sigprof(sampler);
+    }
+
+    lua_sampler_flush(sampler);
+    sampler->max_depth = std::max(max_depth, 1);
+    sampler->capacity = (size_t)std::max(capacity, 1);
+    sampler->frames.assign(sampler->capacity * sampler->max_depth * s_sample_frame_size, 0);
+    sampler->depths.assign(sampler->capacity, 0);
+    sampler->truncated.assign(sampler->capacity, false);
+    sampler->use_sigprof = use_sigprof;
+    sampler->last_tick = s_sigprof_tick;
+    sampler->running = true;
+    if (sampler->use_sigprof) {
+        lua_set_sigprof(sigprof_usec);
+    }
+
+    // hook设在主线程上,此后新建的协程会继承
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    lua_State* main_thread = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    lua_sethook(main_thread ? main_thread : L, lua_sampler_hook, LUA_MASKCOUNT, std::max(instruction_count, 1));
+    return true;
+}
+
+static void lua_sampler_unhook(lua_State* L, luna_sampler* sampler) {
+    if (!sampler->running)
+        return;
+
+    sampler->running = false;
+    if (sampler->use_sigprof) {
+        lua_release_sigprof(sampler);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    lua_State* main_thread = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    lua_sethook(main_thread ? main_thread : L, nullptr, 0, 0);
+}
+
+static void lua_sampler_free(lua_State* L, luna_sampler* sampler) {
+    lua_sampler_unhook(L, sampler);
+    delete sampler;
+}
+
+void lua_sampler_stop(lua_State* L) {
+    luna_sampler* sampler = lua_get_runtime(L)->sampler;
+    if (sampler != nullptr) {
+        lua_sampler_unhook(L, sampler);
+    }
+}
+
+void lua_sampler_reset(lua_State* L) {
+    luna_sampler* sampler = lua_get_runtime(L)->sampler;
+    if (sampler != nullptr) {
+        sampler->head = 0;
+        sampler->size = 0;
+        sampler->samples = 0;
+        sampler->overwritten = 0;
+        sampler->folded.clear();
+    }
+}
+
+std::string lua_sampler_folded(lua_State* L) {
+    std::string text;
+    luna_sampler* sampler = lua_get_runtime(L)->sampler;
+    if (sampler == nullptr)
+        return text;
+
+    lua_sampler_flush(sampler);
+    for (auto& it : sampler->folded) {
+        text += it.first;
+        text += ' ';
+        text += std::to_string(it.second);
+        text += '\n';
+    }
+    return text;
+}
+
+static int lua_luna_profile(lua_State* L) {
+    std::vector<luna_profile_record> records;
+    double ns_per_tick = lua_profile_report(L, &records);
+    lua_createtable(L, (int)records.size(), 0);
+    int i = 0;
+    for (auto& record : records) {
+        lua_createtable(L, 0, 6);
+        lua_pushstring(L, record.name.c_str());
+        lua_setfield(L, -2, "name");
+        lua_pushinteger(L, (lua_Integer)record.count);
+        lua_setfield(L, -2, "count");
+        lua_pushnumber(L, record.ticks * ns_per_tick);
+        lua_setfield(L, -2, "total_ns");
+        lua_pushnumber(L, record.count > 0 ? record.ticks * ns_per_tick / record.count : 0);
+        lua_setfield(L, -2, "avg_ns");
+        lua_pushnumber(L, record.max_ticks * ns_per_tick);
+        lua_setfield(L, -2, "max_ns");
+
+        // histogram = {{le_ns, count}, ...}, 只列出非空的桶
+        lua_newtable(L);
+        int n = 0;
+        for (int bucket = 0; bucket < 64; bucket++) {
+            if (record.histogram[bucket] == 0)
+                continue;
+            lua_createtable(L, 2, 0);
+            lua_pushnumber(L, (double)(bucket < 63 ? (2ull << bucket) : UINT64_MAX) * ns_per_tick);
+            lua_rawseti(L, -2, 1);
+            lua_pushinteger(L, (lua_Integer)record.histogram[bucket]);
+            lua_rawseti(L, -2, 2);
+            lua_rawseti(L, -2, ++n);
+        }
+        lua_setfield(L, -2, "histogram");
+        lua_rawseti(L, -2, ++i);
+    }
+    return 1;
+}
+
+static int lua_luna_profile_start(lua_State* L) {
+    lua_profile_start(L);
+    return 0;
+}
+
+static int lua_luna_profile_stop(lua_State* L) {
+    lua_profile_stop(L);
+    return 0;
+}
+
+static int lua_luna_profile_reset(lua_State* L) {
+    lua_profile_reset(L);
+    return 0;
+}
+
+// luna.census() --> {ClassName = {size, live, peak, created, collected, detached, bytes}, ...}
+static int lua_luna_census(lua_State* L) {
+    std::vector<luna_census_record> records;
+    lua_get_census(L, &records);
+    lua_createtable(L, 0, (int)records.size());
+    for (auto& record : records) {
+        lua_createtable(L, 0, 7);
+#define LUNA_CENSUS_FIELD(name, value) lua_pushinteger(L, (lua_Integer)(value)); lua_setfield(L, -2, name)
+        LUNA_CENSUS_FIELD("size", record.size);
+        LUNA_CENSUS_FIELD("live", record.live);
+        LUNA_CENSUS_FIELD("peak", record.peak);
+        LUNA_CENSUS_FIELD("created", record.created);
+        LUNA_CENSUS_FIELD("collected", record.collected);
+        LUNA_CENSUS_FIELD("detached", record.detached);
+        LUNA_CENSUS_FIELD("bytes", record.live * record.size);
+#undef LUNA_CENSUS_FIELD
+        lua_setfield(L, -2, record.name.c_str());
+    }
+    return 1;
+}
+
+// luna.memory(), 只对luna_newstate创建的lua_State有效,否则返回nil
+static int lua_luna_memory(lua_State* L) {
+    const luna_alloc_stats* stats = luna_get_alloc_stats(L);
+    if (stats == nullptr)
+        return 0;
+
+    lua_createtable(L, 0, 7);
+#define LUNA_MEMORY_FIELD(name, value) lua_pushinteger(L, (lua_Integer)(value)); lua_setfield(L, -2, name)
+    LUNA_MEMORY_FIELD("in_use", stats->in_use);
+    LUNA_MEMORY_FIELD("peak", stats->peak);
+    LUNA_MEMORY_FIELD("quota", stats->quota);
+    LUNA_MEMORY_FIELD("quota_refused", stats->quota_refused);
+    LUNA_MEMORY_FIELD("large", stats->large_count);
+    LUNA_MEMORY_FIELD("heap_dropped", stats->heap_dropped);
+#undef LUNA_MEMORY_FIELD
+    // classes[i]: 尺寸为(i-1)*16+1 ~ i*16字节的分配次数
+    lua_createtable(L, LUNA_ALLOC_CLASSES, 0);
+    for (int i = 0; i < LUNA_ALLOC_CLASSES; i++) {
+        lua_pushinteger(L, (lua_Integer)stats->class_count[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "classes");
+    return 1;
+}
+
+// luna.heap_start([interval], [max_depth]), 不是luna_newstate创建的lua_State返回false
+static int lua_luna_heap_start(lua_State* L) {
+    lua_pushboolean(L, luna_heap_start(L, (size_t)luaL_optinteger(L, 1, 512 * 1024), (int)luaL_optinteger(L, 2, 32)));
+    return 1;
+}
+
+static int lua_luna_heap_stop(lua_State* L) {
+    luna_heap_stop(L);
+    return 0;
+}
+
+static int lua_luna_heap_reset(lua_State* L) {
+    luna_heap_reset(L);
+    return 0;
+}
+
+static int lua_luna_heap_folded(lua_State* L) {
+    std::string text = luna_heap_folded(L);
+    lua_pushlstring(L, text.c_str(), text.size());
+    return 1;
+}
+
+// luna.heap_top([n]) --> {{stack, live, allocated, samples}, ...}
+static int lua_luna_heap_top(lua_State* L) {
+    std::vector<luna_heap_record> records;
+    luna_heap_report(L, &records, (size_t)luaL_optinteger(L, 1, 20));
+    lua_createtable(L, (int)records.size(), 0);
+    int i = 0;
+    for (auto& record : records) {
+        lua_createtable(L, 0, 4);
+        lua_pushlstring(L, record.stack.c_str(), record.stack.size());
+        lua_setfield(L, -2, "stack");
+        lua_pushinteger(L, (lua_Integer)record.live_bytes);
+        lua_setfield(L, -2, "live");
+        lua_pushinteger(L, (lua_Integer)record.alloc_bytes);
+        lua_setfield(L, -2, "allocated");
+        lua_pushinteger(L, (lua_Integer)record.samples);
+        lua_setfield(L, -2, "samples");
+        lua_rawseti(L, -2, ++i);
+    }
+    return 1;
+}
+
+static int lua_luna_stats(lua_State* L) {
+    const luna_stats& stats = lua_get_stats(L);
+    lua_createtable(L, 0, 14);
+#define LUNA_STATS_FIELD(name, value) lua_pushinteger(L, (lua_Integer)(value)); lua_setfield(L, -2, name)
+    LUNA_STATS_FIELD("push_hit", stats.push_hit);
+    LUNA_STATS_FIELD("push_miss", stats.push_miss);
+    LUNA_STATS_FIELD("shadow_created", stats.shadow_created);
+    LUNA_STATS_FIELD("class_registered", stats.class_registered);
+    LUNA_STATS_FIELD("member_index", stats.member_index);
+    LUNA_STATS_FIELD("member_new_index", stats.member_new_index);
+    LUNA_STATS_FIELD("object_bridge", stats.object_bridge);
+    LUNA_STATS_FIELD("global_bridge", stats.global_bridge);
+    LUNA_STATS_FIELD("call_error", stats.call_error);
+    LUNA_STATS_FIELD("object_gc", stats.object_gc);
+    luna_runtime* rt = lua_get_runtime(L);
+    LUNA_STATS_FIELD("shadow_pool_size", rt->shadow_pool_size);
+    LUNA_STATS_FIELD("shadow_pool_hit", rt->shadow_pool_hit);
+    LUNA_STATS_FIELD("shadow_pool_miss", rt->shadow_pool_miss);
+#undef LUNA_STATS_FIELD
+    return 1;
+}
+
+static int lua_luna_sampler_start(lua_State* L) {
+    lua_pushboolean(L, lua_sampler_start(L, (int)luaL_optinteger(L, 1, 1000), (int)luaL_optinteger(L, 2, 0),
+        (int)luaL_optinteger(L, 3, 32), (int)luaL_optinteger(L, 4, 4096)));
+    return 1;
+}
+
+static int lua_luna_sampler_stop(lua_State* L) {
+    lua_sampler_stop(L);
+    return 0;
+}
+
+static int lua_luna_sampler_reset(lua_State* L) {
+    lua_sampler_reset(L);
+    return 0;
+}
+
+// 返回folded stack文本, 样本总数, 被覆盖的样本数
+static int lua_luna_sampler_folded(lua_State* L) {
+    std::string text = lua_sampler_folded(L);
+    luna_sampler* sampler = lua_get_runtime(L)->sampler;
+    lua_pushlstring(L, text.c_str(), text.size());
+    lua_pushinteger(L, sampler ? (lua_Integer)sampler->samples : 0);
+    lua_pushinteger(L, sampler ? (lua_Integer)sampler->overwritten : 0);
+    return 3;
+}
+
+// luna.trace_start([ring_size]), 同时开始记录当前lua_State的gc周期
+static int lua_luna_trace_start(lua_State* L) {
+    luna_trace_watch_gc(L);
+    luna_trace_start((size_t)luaL_optinteger(L, 1, 65536));
+    return 0;
+}
+
+static int lua_luna_trace_stop(lua_State* L) {
+    luna_trace_stop();
+    return 0;
+}
+
+static int lua_luna_trace_clear(lua_State* L) {
+    luna_trace_clear();
+    return 0;
+}
+
+// luna.trace_dump(filename), 不带文件名时返回json字符串
+static int lua_luna_trace_dump(lua_State* L) {
+    const char* filename = luaL_optstring(L, 1, nullptr);
+    if (filename != nullptr) {
+        lua_pushboolean(L, luna_trace_dump(filename));
+        return 1;
+    }
+    std::string json = luna_trace_json();
+    lua_pushlstring(L, json.c_str(), json.size());
+    return 1;
+}
+
+extern "C" int luaopen_luna(lua_State* L) {
+    luaL_Reg funcs[] = {
+        { "stats", lua_luna_stats },
+        { "census", lua_luna_census },
+        { "memory", lua_luna_memory },
+        { "heap_start", lua_luna_heap_start },
+        { "heap_stop", lua_luna_heap_stop },
+        { "heap_reset", lua_luna_heap_reset },
+        { "heap_folded", lua_luna_heap_folded },
+        { "heap_top", lua_luna_heap_top },
+        { "profile", lua_luna_profile },
+        { "profile_start", lua_luna_profile_start },
+        { "profile_stop", lua_luna_profile_stop },
+        { "profile_reset", lua_luna_profile_reset },
+        { "sampler_start", lua_luna_sampler_start },
+        { "sampler_stop", lua_luna_sampler_stop },
+        { "sampler_reset", lua_luna_sampler_reset },
+        { "sampler_folded", lua_luna_sampler_folded },
+        { "trace_start", lua_luna_trace_start },
+        { "trace_stop", lua_luna_trace_stop },
+        { "trace_clear", lua_luna_trace_clear },
+        { "trace_dump", lua_luna_trace_dump },
+        { nullptr, nullptr }
+    };
+    luaL_newlib(L, funcs);
+    return 1;
+}
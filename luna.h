@@ -9,13 +9,67 @@
 #include <string.h>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <functional>
 #include <tuple>
+#include <unordered_map>
 #include <type_traits>
 #include <utility>
+#include <vector>
 #include "lua.hpp"
 
-void stackDump(lua_State* L, int line, const char* filename);
+// 绑定层栈轨迹: 定义LUNA_STACK_TRACE(或DEBUG)后,每个stackDump调用点把(位置,栈顶,栈顶几个值的类型)记录到本线程的环形缓冲
+// 记录时不做格式化和输出,只在lua_stack_trace_dump或者崩溃信号中输出; 未定义时stackDump是空函数,不产生任何代码
+#if defined(LUNA_STACK_TRACE) || defined(DEBUG)
+#define LUNA_STACK_TRACE_ON
+const int LUA_STACK_TRACE_SIZE = 256;
+const int LUA_STACK_TRACE_TYPES = 4;
+
+struct lua_stack_trace_entry {
+    const char* site;   // 调用点的函数名
+    int line;
+    int top;
+    signed char types[LUA_STACK_TRACE_TYPES]; // 从栈顶往下的lua_type,LUA_TNONE表示没有
+};
+
+struct lua_stack_trace_ring {
+    lua_stack_trace_entry entries[LUA_STACK_TRACE_SIZE];
+    uint32_t count;
+};
+
+extern thread_local lua_stack_trace_ring g_lua_stack_trace;
+// 崩溃信号处理函数中通过这个指针找到本线程的环形缓冲: 动态库中访问g_lua_stack_trace要经过__tls_get_addr,
+// 它不是异步信号安全的(首次访问还可能分配内存); 指针用initial-exec模型,只是一次相对于线程指针的读取
+#if defined(__GNUC__) && !defined(_WIN32)
+extern thread_local lua_stack_trace_ring* g_lua_stack_trace_crash __attribute__((tls_model("initial-exec")));
+#else
+extern thread_local lua_stack_trace_ring* g_lua_stack_trace_crash;
+#endif
+
+inline void stackDump(lua_State* L, int line, const char* site) {
+    lua_stack_trace_ring& ring = g_lua_stack_trace;
+    if (g_lua_stack_trace_crash == nullptr) {
+        g_lua_stack_trace_crash = &ring;
+    }
+    lua_stack_trace_entry& entry = ring.entries[ring.count++ % LUA_STACK_TRACE_SIZE];
+    entry.site = site;
+    entry.line = line;
+    entry.top = lua_gettop(L);
+    for (int i = 0; i < LUA_STACK_TRACE_TYPES; i++) {
+        entry.types[i] = (signed char)(i < entry.top ? lua_type(L, -1 - i) : LUA_TNONE);
+    }
+}
+#else
+inline void stackDump(lua_State*, int, const char*) {}
+#endif
+
+// 输出本线程最近的栈轨迹(从旧到新),未开启时输出为空
+std::string lua_stack_trace_text();
+// 直接write到文件描述符,不分配内存,可以在信号处理函数中调用
+void lua_stack_trace_dump(int fd);
+// 在SIGSEGV/SIGBUS/SIGFPE/SIGILL/SIGABRT时输出栈轨迹到stderr,然后按默认方式处理该信号
+// 只输出收到信号的线程(通常即出错的线程)的栈轨迹,其他线程的记录不输出
+void lua_stack_trace_install_crash_handler();
 
 template <typename T> void lua_push_object(lua_State* L, T obj);
 template <typename T> T lua_to_object(lua_State* L, int idx);
@@ -81,6 +135,235 @@ inline int lua_normal_index(lua_State* L, int idx) {
 bool _lua_set_fence(lua_State* L, const void* p);
 void _lua_del_fence(lua_State* L, const void* p);
 
+// 句柄模式下,对象身份由(slot, generation)表示,而不是裸指针
+// slot_map按lua_State+类划分,保存在类元表中; 对象释放后generation递增,旧句柄即失效
+struct lua_slot_map;
+
+struct lua_object_handle {
+    lua_object_handle() {}
+    // 复制出来的对象是新对象,不继承句柄
+    lua_object_handle(const lua_object_handle&) {}
+    lua_object_handle& operator =(const lua_object_handle&) { return *this; }
+
+    lua_slot_map* map = nullptr;
+    uint32_t slot = 0;
+    uint32_t gen = 0;
+};
+
+struct lua_slot_map {
+    struct node {
+        void* obj = nullptr;
+        uint32_t gen = 1; // 从1开始,保证有效句柄非0
+        uint32_t next_free = 0;
+    };
+
+    static lua_Integer encode(uint32_t slot, uint32_t gen) { return (lua_Integer)(((uint64_t)gen << 32) | slot); }
+
+    void* get(lua_Integer handle) const {
+        uint32_t slot = (uint32_t)((uint64_t)handle & 0xFFFFFFFF);
+        uint32_t gen = (uint32_t)((uint64_t)handle >> 32);
+        return (slot < slots.size() && slots[slot].gen == gen) ? slots[slot].obj : nullptr;
+    }
+
+    void alloc(lua_object_handle* handle, void* obj);
+    void release(lua_object_handle* handle);
+
+    std::vector<node> slots;
+    uint32_t free_head = UINT32_MAX;
+    int shadow_ref = LUA_NOREF; // 弱表: slot + 1 --> shadow table
+    lua_State* owner = nullptr; // 所属lua_State的主线程,句柄不能跨lua_State使用
+};
+
+// 类元表中保存slot_map的key,用非字符串key避免被lua_member_index当作成员查到
+inline const void* lua_slot_map_key() { static const char key = 0; return &key; }
+void _lua_new_slot_map(lua_State* L);
+inline lua_State* lua_main_thread(lua_State* L) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    lua_State* main_thread = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    return main_thread;
+}
+void _lua_del_handle(lua_State* L, lua_object_handle* handle);
+
+struct luna_stats {
+    uint64_t push_hit = 0;          // lua_push_object找到已有的影子对象
+    uint64_t push_miss = 0;         // lua_push_object需要新的影子对象
+    uint64_t shadow_created = 0;    // 新分配的影子表(不含缓存池命中)
+    uint64_t class_registered = 0;  // 注册的类元表
+    uint64_t member_index = 0;      // lua_member_index调用
+    uint64_t member_new_index = 0;  // lua_member_new_index调用
+    uint64_t object_bridge = 0;     // 通过_lua_object_bridge调用的成员函数
+    uint64_t global_bridge = 0;     // 通过lua_global_bridge调用的全局函数
+    uint64_t call_error = 0;        // lua_call_function失败
+    uint64_t object_gc = 0;         // 被gc释放的对象
+};
+
+#if defined(LUNA_STATS)
+#define LUNA_STAT(rt, field) ((rt)->stats.field++)
+#else
+#define LUNA_STAT(rt, field) ((void)0)
+#endif
+
+// 导出函数的耗时统计,tick在x86上取自TSC
+struct luna_profile_record {
+    std::string name;
+    uint64_t count = 0;
+    uint64_t ticks = 0;
+    uint64_t max_ticks = 0;
+    uint64_t histogram[64] = {}; // 第i个桶: [2^i, 2^(i+1)) ticks
+};
+
+struct luna_profiler {
+    // 按显示的名字统计: 导出函数的地址在释放后可能被新的导出复用,不能作为key
+    std::unordered_map<std::string, luna_profile_record> records;
+    std::string key; // 拼接名字用,避免每次分配
+    uint64_t start_tick = 0;
+    uint64_t start_ns = 0;
+};
+
+struct luna_sampler;
+struct luna_budget;
+
+// 按导出类统计的存活对象数量,用于发现被lua引用钉住而泄漏的对象
+struct luna_census_record {
+    std::string name;
+    size_t size = 0;        // sizeof(类)
+    uint64_t created = 0;   // 导出到lua(创建影子对象)的次数
+    uint64_t collected = 0; // 被gc释放的次数
+    uint64_t detached = 0;  // 被lua_detach的次数
+    uint64_t live = 0;
+    uint64_t peak = 0;
+    uint64_t alarm_at = 0;  // live达到此值时告警,0表示不告警
+};
+
+using luna_census_alarm = std::function<void(lua_State* L, const luna_census_record& record)>;
+
+// 每个lua_State一份的luna运行时数据,保存在注册表中
+struct luna_runtime {
+    // 影子表缓存池: 每个类最多缓存的影子表数量,0表示不缓存
+    int shadow_pool_max = 0;
+    size_t shadow_pool_size = 0;
+    uint64_t shadow_pool_hit = 0;
+    uint64_t shadow_pool_miss = 0;
+
+    // 绑定层热点路径的计数,需要定义LUNA_STATS才会统计
+    luna_stats stats;
+
+    // 开启profiler时指向profile,否则为nullptr; 关闭时只有一次指针判断的开销
+    luna_profiler* profiler = nullptr;
+    luna_profiler profile;
+
+    // lua_sampler_start时创建
+    luna_sampler* sampler = nullptr;
+
+    // lua_call_function的执行预算,0表示不限制; budget指向当前正在执行的预算(嵌套调用时链起来)
+    uint64_t budget_instructions = 0;
+    uint32_t budget_timeout_ms = 0;
+    luna_budget* budget = nullptr;
+    bool call_timeout = false;
+
+    // key为类名,指向record.name; 不能用lua_get_meta_name()返回的指针,同一个字符串常量在不同的编译单元或动态库中地址可能不同
+    std::unordered_map<std::string_view, luna_census_record> census;
+    uint64_t census_alarm_live = 0;
+    luna_census_alarm census_alarm;
+
+    // lua_shutdown时置位,此后对象的__gc不再维护注册表中的fence/句柄/缓存池
+    bool closing = false;
+    // 关闭过程中收集的对象,按类交给批量释放函数(__gc_bulk),在所有对象的__gc之后执行
+    using bulk_release_func = void(*)(void** objects, size_t count);
+    std::vector<std::pair<bulk_release_func, std::vector<void*>>> bulk_list;
+    void add_bulk(bulk_release_func func, void* obj);
+};
+
+inline const void* lua_runtime_key() { static const char key = 0; return &key; }
+luna_runtime* lua_get_runtime(lua_State* L);
+// luna注册的元方法都以runtime作为第一个upvalue
+inline luna_runtime* lua_upvalue_runtime(lua_State* L) { return (luna_runtime*)lua_touserdata(L, lua_upvalueindex(1)); }
+inline const luna_stats& lua_get_stats(lua_State* L) { return lua_get_runtime(L)->stats; }
+// lua中通过require "luna"或者luaL_requiref加载,提供luna.stats()等接口
+extern "C" int luaopen_luna(lua_State* L);
+
+// 导出函数profiler: 统计lua_global_bridge,_lua_object_bridge以及lua_member_index取值的调用次数和耗时分布
+// lua中对应luna.profile_start(),luna.profile_stop(),luna.profile_reset(),luna.profile()
+void lua_profile_start(lua_State* L);
+void lua_profile_stop(lua_State* L);
+void lua_profile_reset(lua_State* L);
+// 结果按总耗时从高到低排序,返回值为每个tick对应的纳秒数
+double lua_profile_report(lua_State* L, std::vector<luna_profile_record>* records);
+uint64_t luna_tick();
+void _lua_profile_add(luna_runtime* rt, const char* meta_name, char sep, const char* name, uint64_t ticks);
+
+// 采样profiler: 每执行instruction_count条lua指令由count hook采一次调用栈,用于生成火焰图
+// sigprof_usec > 0时改为由SIGPROF定时器置位标志,hook检查到标志才采样(按CPU时间采样,不支持windows)
+// 样本写入预分配的环形缓冲(capacity个样本,每个最多max_depth帧),hook中不分配内存,缓冲满时覆盖最旧的样本
+// lua中对应luna.sampler_start(),luna.sampler_stop(),luna.sampler_reset(),luna.sampler_folded()
+// 注意: 会覆盖lua_sethook/debug.sethook设置的hook; 只作用于主线程以及此后新建的协程
+// SIGPROF定时器是整个进程共用的,同时只能有一个lua_State用sigprof_usec采样,其他lua_State再要求时返回false
+bool lua_sampler_start(lua_State* L, int instruction_count = 1000, int sigprof_usec = 0, int max_depth = 32, int capacity = 4096);
+void lua_sampler_stop(lua_State* L);
+void lua_sampler_reset(lua_State* L);
+// Brendan Gregg的folded stack格式,每行: "根帧;...;叶子帧 样本数", 可直接交给flamegraph.pl
+// 导出的C++函数帧标记为"name [C++]",其他C函数为"name [C]",lua函数为"name@source:line"
+std::string lua_sampler_folded(lua_State* L);
+// 格式化一个栈帧,函数需已由lua_getinfo(L, "Snf", ar)压栈,heap profiler中也使用
+void _lua_sample_frame(lua_State* L, lua_Debug* ar, char* out, size_t size);
+
+// 导出对象普查: 在lua_push_object,lua_object_gc,lua_detach中增量维护每个类的计数,lua中对应luna.census()
+void lua_get_census(lua_State* L, std::vector<luna_census_record>* records);
+// 任一类的存活对象数达到live_limit时调用alarm,之后该类的告警阈值翻倍; live_limit为0表示关闭告警
+void lua_set_census_alarm(lua_State* L, uint64_t live_limit, luna_census_alarm alarm);
+void _lua_census_add(lua_State* L, const char* meta_name, size_t size);
+void _lua_census_remove(luna_runtime* rt, const char* meta_name, bool detached);
+
+// 快速关闭持有大量导出对象的lua_State: 标记为closing后调用lua_close
+// 对象的__gc中跳过所有逐个对象的注册表维护; 由luna_newstate创建的lua_State会同时释放分配器;
+// 如果类实现了静态函数: static void __gc_bulk(T** objects, size_t count),则对象不再逐个delete,而是关闭时一次性交给它释放
+void lua_shutdown(lua_State* L);
+
+// 影子表缓存池,用于创建销毁频繁的导出对象,默认关闭
+// 注意: 只有在__gc中回收的影子表才会进入缓存池,lua_detach的影子表可能仍被lua引用,不会回收
+// 如果lua代码中用影子对象做了弱key表的key,开启缓存池后可能在下一轮gc前关联到新对象上
+inline void lua_set_shadow_pool(lua_State* L, int max_per_class) { lua_get_runtime(L)->shadow_pool_max = max_per_class; }
+inline const void* lua_shadow_pool_key() { static const char key = 0; return &key; }
+// 栈顶为类元表,压入一个已设置该元表的影子表
+void _lua_new_shadow(lua_State* L);
+void _lua_recycle_shadow(lua_State* L, int idx, luna_runtime* rt);
+
+template<typename T>
+struct has_lua_handle {
+    template<typename U> static auto check_handle(int) -> decltype(std::declval<U>().m_lua_handle, std::true_type());
+    template<typename U> static std::false_type check_handle(...);
+    enum { value = std::is_same<decltype(check_handle<T>(0)), std::true_type>::value };
+};
+
+// 压入类的元方法闭包: upvalue 1为runtime,句柄模式下upvalue 2为slot_map
+inline void lua_push_meta_closure(lua_State* L, lua_CFunction func, lua_slot_map* map) {
+    lua_pushlightuserdata(L, lua_get_runtime(L));
+    if (map == nullptr) {
+        lua_pushcclosure(L, func, 1);
+        return;
+    }
+    lua_pushlightuserdata(L, map);
+    lua_pushcclosure(L, func, 2);
+}
+
+// 元方法中取self(栈上1号位置); 句柄模式下直接用upvalue中的slot_map,不用再查元表
+template <typename T>
+T* lua_upvalue_self(lua_State* L) {
+    if constexpr (has_lua_handle<T>::value) {
+        auto map = (lua_slot_map*)lua_touserdata(L, lua_upvalueindex(2));
+        if (map == nullptr || !lua_istable(L, 1))
+            return nullptr;
+        lua_pushstring(L, "__handle__");
+        lua_rawget(L, 1);
+        lua_Integer handle = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        return handle != 0 ? (T*)map->get(handle) : nullptr;
+    } else {
+        return lua_to_object<T*>(L, 1);
+    }
+}
+
 using lua_global_function = std::function<int(lua_State*)>;
 using lua_object_function = std::function<int(void*, lua_State*)>;
 
@@ -174,6 +457,22 @@ lua_object_function lua_adapter(int(T::*func)(lua_State* L) const) {
 using luna_member_wrapper = std::function<void(lua_State*, void*, char*)>;
 
 int _lua_object_bridge(lua_State* L);
+// 开启profiler时压入带名字的成员函数闭包,只在lua_member_index中调用(upvalue 1即runtime)
+void _lua_push_object_bridge(lua_State* L, void* obj, lua_object_function* func, const char* meta_name);
+
+// 压入成员函数的闭包: _lua_object_bridge(obj, adapter); 没有开启profiler时只多一次指针判断
+template <typename T>
+inline void lua_push_object_bridge(lua_State* L, T* obj, lua_object_function* func) {
+    luna_runtime* rt = lua_upvalue_runtime(L);
+    if (rt == nullptr || rt->profiler == nullptr) {
+        //table, 'func_a', obj, adapter(global Func)
+        lua_pushlightuserdata(L, obj);
+        lua_pushlightuserdata(L, func);
+        lua_pushcclosure(L, _lua_object_bridge, 2);
+        return;
+    }
+    _lua_push_object_bridge(L, obj, func, obj->lua_get_meta_name());
+}
 
 struct lua_export_helper {
     static luna_member_wrapper getter(const bool&) {
@@ -278,14 +577,9 @@ struct lua_export_helper {
 		        //table, 'func_a'
                 stackDump(L, __LINE__, __FUNCTION__);
 
-                //table, 'func_a', obj
-				lua_pushlightuserdata(L, obj);
-                //table, 'func_a', obj, adapter(global Func)
-				lua_pushlightuserdata(L, &adapter);
-
                 //table, 'func_a', _lua_object_bridge
                 //_lua_object_bridge(obj, adapter)
-				lua_pushcclosure(L, _lua_object_bridge, 2);
+				lua_push_object_bridge(L, (T*)obj, &adapter);
                 stackDump(L, __LINE__, __FUNCTION__);
 			};
 	}
@@ -303,9 +597,7 @@ struct lua_export_helper {
 	static luna_member_wrapper getter(return_type(T::*func)(arg_types...) const) {
 		return [adapter=lua_adapter(func)](lua_State* L, void* obj, char*) mutable {
             stackDump(L, __LINE__, __FUNCTION__);
-				lua_pushlightuserdata(L, obj);
-				lua_pushlightuserdata(L, &adapter);
-				lua_pushcclosure(L, _lua_object_bridge, 2);
+				lua_push_object_bridge(L, (T*)obj, &adapter);
             stackDump(L, __LINE__, __FUNCTION__);
 			};
 	}
@@ -330,8 +622,10 @@ struct lua_member_item {
 template <typename T>
 int lua_member_index(lua_State* L) {
     //tObj, key
+    luna_runtime* rt = lua_upvalue_runtime(L);
+    LUNA_STAT(rt, member_index);
     stackDump(L, __LINE__, __FUNCTION__);
-    T* obj = lua_to_object<T*>(L, 1); //强制转换为对象指针
+    T* obj = lua_upvalue_self<T>(L); //强制转换为对象指针
     if (obj == nullptr) {
         lua_pushnil(L);
         return 1;
@@ -367,7 +661,13 @@ int lua_member_index(lua_State* L) {
     //tObj, key,
     lua_settop(L, 2);
     stackDump(L, __LINE__, __FUNCTION__);
-    item->getter(L, obj, (char*)obj + item->offset); //lua_export_helper::getter(&class_type::Method/member)
+    if (rt->profiler == nullptr) {
+        item->getter(L, obj, (char*)obj + item->offset); //lua_export_helper::getter(&class_type::Method/member)
+    } else {
+        uint64_t tick = luna_tick();
+        item->getter(L, obj, (char*)obj + item->offset);
+        _lua_profile_add(rt, meta_name, '.', key, luna_tick() - tick);
+    }
     stackDump(L, __LINE__, __FUNCTION__);
     //压入数据
     //tObj, key, val
@@ -377,8 +677,9 @@ int lua_member_index(lua_State* L) {
 template <typename T>
 int lua_member_new_index(lua_State* L) {
     //tObj, mem_name, value
+    LUNA_STAT(lua_upvalue_runtime(L), member_new_index);
     stackDump(L, __LINE__, __FUNCTION__);
-    T* obj = lua_to_object<T*>(L, 1);
+    T* obj = lua_upvalue_self<T>(L);
     if (obj == nullptr)
         return 0;
 
@@ -431,13 +732,56 @@ struct has_member_gc {
     enum { value = std::is_same<decltype(check_gc<T>(0)), std::true_type>::value };
 };
 
+template<typename T>
+struct has_member_gc_bulk {
+    template<typename U> static auto check_gc_bulk(int) -> decltype(U::__gc_bulk((U**)nullptr, (size_t)0), std::true_type());
+    template<typename U> static std::false_type check_gc_bulk(...);
+    enum { value = std::is_same<decltype(check_gc_bulk<T>(0)), std::true_type>::value };
+};
+
+template <typename T>
+void lua_bulk_release(void** objects, size_t count) {
+    T::__gc_bulk((T**)objects, count);
+}
+
 template <typename T>
 int lua_object_gc(lua_State* L) {
-    T* obj = lua_to_object<T*>(L, 1);
+    T* obj = lua_upvalue_self<T>(L);
     if (obj == nullptr)
         return 0;
 
-    _lua_del_fence(L, obj);
+    auto rt = lua_upvalue_runtime(L);
+    if (rt != nullptr) {
+        LUNA_STAT(rt, object_gc);
+    }
+    if (rt != nullptr && rt->closing) {
+        if constexpr (has_lua_handle<T>::value) {
+            // slot_map随lua_State一起释放,只需让对象忘掉句柄
+            obj->m_lua_handle.map = nullptr;
+        }
+
+        if constexpr (has_member_gc_bulk<T>::value) {
+            rt->add_bulk(&lua_bulk_release<T>, obj);
+        } else if constexpr (has_member_gc<T>::value) {
+            obj->__gc();
+        } else {
+            delete obj;
+        }
+        return 0;
+    }
+
+    if constexpr (has_lua_handle<T>::value) {
+        _lua_del_handle(L, &obj->m_lua_handle);
+    } else {
+        _lua_del_fence(L, obj);
+    }
+    if (rt != nullptr) {
+        _lua_census_remove(rt, obj->lua_get_meta_name(), false);
+    }
+
+    if (rt != nullptr && rt->shadow_pool_max > 0) {
+        _lua_recycle_shadow(L, 1, rt);
+    }
 
     if constexpr (has_member_gc<T>::value) {
         obj->__gc();
@@ -453,6 +797,7 @@ void lua_register_class(lua_State* L, T* obj) {
     stackDump(L, __LINE__, __FUNCTION__);
 
     int top = lua_gettop(L); //stack num
+    LUNA_STAT(lua_get_runtime(L), class_registered);
 
     const char* meta_name = obj->lua_get_meta_name(); //"_class_meta:"#ClassName
     lua_member_item* item = obj->lua_get_meta_data();
@@ -462,12 +807,21 @@ void lua_register_class(lua_State* L, T* obj) {
     luaL_newmetatable(L, meta_name);
     stackDump(L, __LINE__, __FUNCTION__);
 
+    lua_slot_map* map = nullptr;
+    if constexpr (has_lua_handle<T>::value) {
+        // ..., tObj, _G."_class_meta:"#ClassName, slot_map
+        // slot_map由元表持有,同时作为元方法的upvalue
+        _lua_new_slot_map(L);
+        map = (lua_slot_map*)lua_touserdata(L, -1);
+        lua_rawsetp(L, -2, lua_slot_map_key());
+    }
+
     // LUA_REGISTRYINDEX.__objects__, tObj, _G."_class_meta:"#ClassName, __index
     lua_pushstring(L, "__index");
     stackDump(L, __LINE__, __FUNCTION__);
 
     // LUA_REGISTRYINDEX.__objects__, tObj, _G."_class_meta:"#ClassName, __index， indexFunc(_lua_object_bridge)
-    lua_pushcfunction(L, &lua_member_index<T>);
+    lua_push_meta_closure(L, &lua_member_index<T>, map);
     stackDump(L, __LINE__, __FUNCTION__);
 
     // LUA_REGISTRYINDEX.__objects__, tObj, _G."_class_meta:"#ClassName,
@@ -482,7 +836,7 @@ void lua_register_class(lua_State* L, T* obj) {
 
     // ..., tObj, _G."_class_meta:"#ClassName, __newindex, newIndexFunc
     //_G."_class_meta:"#ClassName = {_index = newIndexFunc}
-    lua_pushcfunction(L, &lua_member_new_index<T>);
+    lua_push_meta_closure(L, &lua_member_new_index<T>, map);
     stackDump(L, __LINE__, __FUNCTION__);
 
     // ..., tObj, _G."_class_meta:"#ClassName,
@@ -497,7 +851,8 @@ void lua_register_class(lua_State* L, T* obj) {
 
     // ..., tObj, _G."_class_meta:"#ClassName,  __gc, gcFunc
     //_G."_class_meta:"#ClassName = {_index = indexFunc, __newindex = newIndexFunc}
-    lua_pushcfunction(L, &lua_object_gc<T>);
+    //gcFunc带upvalue: luna_runtime(句柄模式下还有slot_map)
+    lua_push_meta_closure(L, &lua_object_gc<T>, map);
     stackDump(L, __LINE__, __FUNCTION__);
 
     // ..., tObj, _G."_class_meta:"#ClassName,
@@ -549,6 +904,55 @@ void lua_register_class(lua_State* L, T* obj) {
     stackDump(L, __LINE__, __FUNCTION__);
 }
 
+template <typename T>
+void lua_push_handle_object(lua_State* L, T* obj) {
+    lua_object_handle& handle = obj->m_lua_handle;
+    if (handle.map != nullptr) {
+        // shadow_ref只在所属的lua_State中有效,不能拿到别的lua_State的注册表里去取
+        if (handle.map->owner != lua_main_thread(L)) {
+            luaL_error(L, "%s is already exported to another lua_State", obj->lua_get_meta_name());
+        }
+        // 句柄有效时,slot一定处于占用状态,直接按数组下标取影子对象
+        // 取到nil说明影子对象已被回收但__gc尚未执行,与fence的处理一致,返回nil
+        lua_rawgeti(L, LUA_REGISTRYINDEX, handle.map->shadow_ref);
+        lua_rawgeti(L, -1, (lua_Integer)handle.slot + 1);
+        lua_remove(L, -2);
+        LUNA_STAT(lua_get_runtime(L), push_hit);
+        return;
+    }
+
+    LUNA_STAT(lua_get_runtime(L), push_miss);
+    const char* meta_name = obj->lua_get_meta_name();
+    luaL_getmetatable(L, meta_name);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_register_class(L, obj);
+        luaL_getmetatable(L, meta_name);
+    }
+
+    // meta, slot_map
+    lua_rawgetp(L, -1, lua_slot_map_key());
+    auto map = (lua_slot_map*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    map->alloc(&handle, obj);
+    _lua_census_add(L, meta_name, sizeof(T));
+
+    // meta, tObj
+    _lua_new_shadow(L);
+    lua_pushstring(L, "__handle__");
+    lua_pushinteger(L, lua_slot_map::encode(handle.slot, handle.gen));
+    lua_rawset(L, -3);
+
+    // meta, tObj, shadows, tObj
+    lua_rawgeti(L, LUA_REGISTRYINDEX, map->shadow_ref);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, (lua_Integer)handle.slot + 1);
+    lua_pop(L, 1);
+
+    // tObj
+    lua_remove(L, -2);
+}
+
 template <typename T>
 void lua_push_object(lua_State* L, T obj) {
     stackDump(L, __LINE__, __FUNCTION__);
@@ -557,6 +961,11 @@ void lua_push_object(lua_State* L, T obj) {
         return;
     }
 
+    if constexpr (has_lua_handle<std::remove_cv_t<std::remove_pointer_t<T>>>::value) {
+        lua_push_handle_object(L, obj);
+        return;
+    }
+
     lua_getfield(L, LUA_REGISTRYINDEX, "__objects__");
     stackDump(L, __LINE__, __FUNCTION__);
     if (lua_isnil(L, -1)) {
@@ -602,6 +1011,7 @@ void lua_push_object(lua_State* L, T obj) {
     // LUA_REGISTRYINDEX.__objects__, LUA_REGISTRYINDEX.__objects__.obj
     stackDump(L, __LINE__, __FUNCTION__);
     if (lua_rawgetp(L, -1, obj) != LUA_TTABLE) {
+        LUNA_STAT(lua_get_runtime(L), push_miss);
         //说明对象obj还没有完全导出来
         //LUA_REGISTRYINDEX.__objects__, LUA_REGISTRYINDEX.__objects__.obj
         if (!_lua_set_fence(L, obj)) {
@@ -616,34 +1026,16 @@ void lua_push_object(lua_State* L, T obj) {
         //LUA_REGISTRYINDEX.__objects__
         lua_pop(L, 1);
 
-        //LUA_REGISTRYINDEX.__objects__, tObj
-        lua_newtable(L);
-
-        //LUA_REGISTRYINDEX.__objects__, tObj, __pointer__
-        lua_pushstring(L, "__pointer__");
-
-        //LUA_REGISTRYINDEX.__objects__, tObj, __pointer__, obj
-        lua_pushlightuserdata(L, obj);
-
-        /*
-         * LUA_REGISTRYINDEX.__objects__, tObj
-         * tObj = {__pointer__ = obj}
-         * */
-        lua_rawset(L, -3);
-
-        // LUA_REGISTRYINDEX.__objects__, tObj
+        // LUA_REGISTRYINDEX.__objects__
         const char* meta_name = obj->lua_get_meta_name(); //_G."_class_meta:"#ClassName.meta
 
-        // LUA_REGISTRYINDEX.__objects__, tObj, _G."_class_meta:"#ClassName.meta or nil
+        // LUA_REGISTRYINDEX.__objects__, _G."_class_meta:"#ClassName.meta or nil
         luaL_getmetatable(L, meta_name);
 
         if (lua_isnil(L, -1)) {
-            // LUA_REGISTRYINDEX.__objects__, tObj, nil
-
-            // LUA_REGISTRYINDEX.__objects__, tObj
+            // LUA_REGISTRYINDEX.__objects__
             lua_remove(L, -1);
 
-            // ..., tObj,
             /*
              * _G."_class_meta:"#ClassName = {__index = indexTab, __newindex = newindexTab, __gc = gcTab
              *              mem_name1 = item1,
@@ -654,22 +1046,31 @@ void lua_push_object(lua_State* L, T obj) {
             lua_register_class(L, obj);
             stackDump(L, __LINE__, __FUNCTION__);
 
-            // LUA_REGISTRYINDEX.__objects__, tObj,  _G."_class_meta:"#ClassName.meta
+            // LUA_REGISTRYINDEX.__objects__, _G."_class_meta:"#ClassName.meta
             luaL_getmetatable(L, meta_name);
             stackDump(L, __LINE__, __FUNCTION__);
         }
 
-        // LUA_REGISTRYINDEX.__objects__, tObj,  _G."_class_meta:"#ClassName.meta
+        /*
+         * LUA_REGISTRYINDEX.__objects__, _G."_class_meta:"#ClassName.meta, tObj
+         * tObj.meta = _G."_class_meta:"#ClassName.meta
+         * 开启了影子表缓存池时,tObj优先从池中取
+         */
+        _lua_new_shadow(L);
+
+        //LUA_REGISTRYINDEX.__objects__, _G."_class_meta:"#ClassName.meta, tObj, __pointer__, obj
+        lua_pushstring(L, "__pointer__");
+        lua_pushlightuserdata(L, obj);
 
         /*
-         * LUA_REGISTRYINDEX.__objects__, tObj,
-         tObj.meta = _G."_class_meta:"#ClassName.meta
-         _G."_class_meta:"#ClassName = {__index = indexTab, __newindex = newindexTab, __gc = gcTab
-                           mem_name1 = item1,
-                           mem_name2 = item2,
-                          }
-        */
-        lua_setmetatable(L, -2);
+         * LUA_REGISTRYINDEX.__objects__, _G."_class_meta:"#ClassName.meta, tObj
+         * tObj = {__pointer__ = obj}
+         * */
+        lua_rawset(L, -3);
+
+        // LUA_REGISTRYINDEX.__objects__, tObj
+        lua_remove(L, -2);
+        _lua_census_add(L, meta_name, sizeof(std::remove_pointer_t<T>));
 
         /*
         * LUA_REGISTRYINDEX.__objects__, tObj, tObj
@@ -683,6 +1084,8 @@ void lua_push_object(lua_State* L, T obj) {
         * LUA_REGISTRYINDEX.__objects__.obj = tObj
         */
         lua_rawsetp(L, -3, obj);
+    } else {
+        LUNA_STAT(lua_get_runtime(L), push_hit);
     }
     stackDump(L, __LINE__, __FUNCTION__);
 
@@ -698,6 +1101,27 @@ void lua_detach(lua_State* L, T obj) {
     if (obj == nullptr)
         return;
 
+    if constexpr (has_lua_handle<std::remove_cv_t<std::remove_pointer_t<T>>>::value) {
+        lua_object_handle& handle = obj->m_lua_handle;
+        if (handle.map == nullptr || handle.map->owner != lua_main_thread(L))
+            return;
+
+        // stack: shadows, __shadow_object__
+        lua_rawgeti(L, LUA_REGISTRYINDEX, handle.map->shadow_ref);
+        if (lua_rawgeti(L, -1, (lua_Integer)handle.slot + 1) == LUA_TTABLE) {
+            lua_pushstring(L, "__handle__");
+            lua_pushnil(L);
+            lua_rawset(L, -3);
+        }
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_rawseti(L, -2, (lua_Integer)handle.slot + 1);
+        lua_pop(L, 1);
+        _lua_del_handle(L, &handle);
+        _lua_census_remove(lua_get_runtime(L), obj->lua_get_meta_name(), true);
+        return;
+    }
+
     _lua_del_fence(L, obj);
 
     lua_getfield(L, LUA_REGISTRYINDEX, "__objects__");
@@ -720,6 +1144,7 @@ void lua_detach(lua_State* L, T obj) {
     lua_pushnil(L);
     lua_rawsetp(L, -3, obj);
     lua_pop(L, 2);
+    _lua_census_remove(lua_get_runtime(L), obj->lua_get_meta_name(), true);
 }
 
 template<typename T>
@@ -740,7 +1165,25 @@ T lua_to_object(lua_State* L, int idx) {//伪索引
     idx = lua_normal_index(L, idx);
 
     //类对象
-    if (lua_istable(L, idx)) {
+    if constexpr (has_lua_handle<std::remove_cv_t<std::remove_pointer_t<T>>>::value) {
+        if (lua_istable(L, idx)) {
+            //tObj .., handle
+            lua_pushstring(L, "__handle__");
+            lua_rawget(L, idx);
+            lua_Integer handle = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+
+            //tObj .., meta, slot_map
+            if (handle != 0 && lua_getmetatable(L, idx)) {
+                lua_rawgetp(L, -1, lua_slot_map_key());
+                auto map = (lua_slot_map*)lua_touserdata(L, -1);
+                if (map != nullptr) {
+                    obj = (T)map->get(handle);
+                }
+                lua_pop(L, 2);
+            }
+        }
+    } else if (lua_istable(L, idx)) {
         //tObj ..
         //tObj .., __pointer__
         lua_pushstring(L, "__pointer__");
@@ -763,6 +1206,12 @@ T lua_to_object(lua_State* L, int idx) {//伪索引
     const char* lua_get_meta_name() { return "_class_meta:"#ClassName; }    \
     lua_member_item* lua_get_meta_data();
 
+// 句柄模式: 对象以(slot, generation)句柄导出,地址被复用时旧的影子对象不会指向新对象
+// 注意句柄模式的对象同一时间只能导出到一个lua_State,导出到第二个lua_State时会抛出lua错误
+#define DECLARE_LUA_CLASS_HANDLE(ClassName)    \
+    DECLARE_LUA_CLASS(ClassName)    \
+    lua_object_handle m_lua_handle;
+
 #define LUA_EXPORT_CLASS_BEGIN(ClassName)   \
 lua_member_item* ClassName::lua_get_meta_data() { \
     using class_type = ClassName;  \
@@ -784,21 +1233,22 @@ lua_member_item* ClassName::lua_get_meta_data() { \
 #define LUA_EXPORT_METHOD(Method) LUA_EXPORT_METHOD_AS(Method, #Method)
 #define LUA_EXPORT_METHOD_READONLY(Method) LUA_EXPORT_METHOD_READONLY_AS(Method, #Method)
 
-void lua_push_function(lua_State* L, lua_global_function func);
-inline void lua_push_function(lua_State* L, lua_CFunction func) { lua_pushcfunction(L, func); }
+// name用于profiler中显示
+void lua_push_function(lua_State* L, lua_global_function func, const char* name = nullptr);
+inline void lua_push_function(lua_State* L, lua_CFunction func, const char* name = nullptr) { lua_pushcfunction(L, func); }
 
 template <typename T>
-void lua_push_function(lua_State* L, T func) {
+void lua_push_function(lua_State* L, T func, const char* name = nullptr) {
     //c_function:
     //          a.可能是原生的，
     //          b. 或者是lua_global_bridge包装的
-    lua_push_function(L, lua_adapter(func));
+    lua_push_function(L, lua_adapter(func), name);
 }
 
 template <typename T>
 void lua_register_function(lua_State* L, const char* name, T func) {
     stackDump(L, __LINE__, __FUNCTION__);
-    lua_push_function(L, func);
+    lua_push_function(L, func, name);
     stackDump(L, __LINE__, __FUNCTION__);
     lua_setglobal(L, name);
 }
@@ -813,7 +1263,7 @@ bool lua_get_table_function(lua_State* L, const char table[], const char functio
 template <typename T>
 void lua_set_table_function(lua_State* L, int idx, const char name[], T func) {
     idx = lua_normal_index(L, idx);
-    lua_push_function(L, func);
+    lua_push_function(L, func, name);
     lua_setfield(L, idx, name);
 }
 
@@ -832,6 +1282,21 @@ void lua_to_native_mutil(lua_State* L, std::tuple<var_types&...>& vars, std::ind
     int _[] = { 0, (std::get<integers>(vars) = lua_to_native<var_types>(L, (int)integers - (int)sizeof...(integers)), 0)... };
 }
 
+// 执行预算: 设置后,此lua_State上的每次lua_call_function(包括各个lua_call_*_function)最多执行instructions条指令或timeout_ms毫秒
+// 超出时抛出以LUNA_CALL_TIMEOUT开头的错误,通过err返回,lua_call_timed_out(L)返回true; 两者都为0表示取消预算
+// 预算通过count hook检查,未设置预算时不安装hook; 执行期间会替换原来的hook(原来的count hook仍按它自己的间隔被调用,调用期间新装的hook会保留),协程内部不受限制
+// 嵌套调用(lua->C++->lua)的预算不超过外层剩余的额度,消耗的指令数也记到外层
+#define LUNA_CALL_TIMEOUT "luna call timeout"
+void lua_set_call_budget(lua_State* L, uint64_t instructions, uint32_t timeout_ms);
+bool lua_call_timed_out(lua_State* L);
+// 供临时替换hook的组件(例如堆采样)在换回预算hook之后调用: 换回时hook计数被清零,这里补查一次预算(记1条指令)
+void _lua_budget_poll(lua_State* L);
+// 堆采样的一次性hook已经装上且保存的是from时,把它保存的hook换成to,返回是否替换(见luna_alloc.cpp)
+bool _luna_heap_replace_hook(lua_State* L, lua_Hook from, lua_Hook to, int mask, int count);
+// 协作模式: 在协程co中执行(或继续执行)函数,预算用完时让出而不是报错,返回lua_resume的结果
+// 返回LUA_YIELD且*exhausted为true表示预算用完,调用方可以稍后以nargs = 0再次调用以继续执行
+int lua_resume_budget(lua_State* co, lua_State* from, int nargs, uint64_t instructions, uint32_t timeout_ms, bool* exhausted);
+
 bool lua_call_function(lua_State* L, std::string* err, int arg_count, int ret_count);
 
 template <typename... ret_types, typename... arg_types>
@@ -0,0 +1,421 @@
+﻿/*
+** repository: https://github.com/trumanzhao/luna
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include "lua.hpp"
+#include "luna.h"
+#include "luna_alloc.h"
+
+// 每次向系统申请的slab大小
+static const size_t s_slab_size = 64 * 1024;
+
+struct luna_free_block {
+    luna_free_block* next;
+};
+
+// 线程退出时剩余的空闲块
+struct luna_alloc_depot {
+    std::mutex lock;
+    luna_free_block* lists[LUNA_ALLOC_CLASSES] = {};
+};
+
+static luna_alloc_depot s_depot;
+
+struct luna_thread_cache {
+    luna_free_block* lists[LUNA_ALLOC_CLASSES] = {};
+
+    ~luna_thread_cache() {
+        std::lock_guard<std::mutex> guard(s_depot.lock);
+        for (int i = 0; i < LUNA_ALLOC_CLASSES; i++) {
+            luna_free_block* head = lists[i];
+            if (head == nullptr)
+                continue;
+            luna_free_block* tail = head;
+            while (tail->next != nullptr) {
+                tail = tail->next;
+            }
+            tail->next = s_depot.lists[i];
+            s_depot.lists[i] = head;
+        }
+    }
+};
+
+static thread_local luna_thread_cache t_cache;
+
+static const int s_heap_pending_max = 64;
+
+struct luna_heap_sample {
+    void* ptr;
+    size_t weight;
+};
+
+struct luna_heap_profiler {
+    lua_State* L = nullptr; // 主线程, hook设置在它上面
+    bool active = false;
+    size_t interval = 0;
+    size_t countdown = 0;
+    int max_depth = 0;
+    // 等待hook记录调用栈的样本,分配器中不分配内存
+    bool armed = false;
+    lua_Hook old_hook = nullptr;
+    int old_mask = 0;
+    int old_count = 0;
+    luna_heap_sample pending[s_heap_pending_max];
+    int pending_count = 0;
+    // 已记录的样本: 内存块 --> (调用栈下标, 代表的字节数)
+    std::unordered_map<void*, std::pair<size_t, size_t>> live;
+    std::vector<luna_heap_record> stacks;
+    std::unordered_map<std::string, size_t> stack_index;
+};
+
+struct luna_allocator {
+    luna_alloc_stats stats;
+    luna_heap_profiler* heap = nullptr;
+};
+
+static inline int luna_size_class(size_t size) {
+    return (int)((size - 1) / LUNA_ALLOC_GRANULE);
+}
+
+static bool luna_refill(luna_thread_cache& cache, int cls) {
+    {
+        std::lock_guard<std::mutex> guard(s_depot.lock);
+        if (s_depot.lists[cls] != nullptr) {
+            cache.lists[cls] = s_depot.lists[cls];
+            s_depot.lists[cls] = nullptr;
+            return true;
+        }
+    }
+
+    char* slab = (char*)malloc(s_slab_size);
+    if (slab == nullptr)
+        return false;
+
+    size_t block_size = (cls + 1) * LUNA_ALLOC_GRANULE;
+    size_t count = s_slab_size / block_size;
+    luna_free_block* head = nullptr;
+    for (size_t i = count; i > 0; i--) {
+        auto block = (luna_free_block*)(slab + (i - 1) * block_size);
+        block->next = head;
+        head = block;
+    }
+    cache.lists[cls] = head;
+    return true;
+}
+
+static void* luna_alloc_block(luna_allocator* allocator, size_t size) {
+    if (size > LUNA_ALLOC_SMALL_MAX) {
+        allocator->stats.large_count++;
+        return malloc(size);
+    }
+
+    int cls = luna_size_class(size);
+    luna_thread_cache& cache = t_cache;
+    if (cache.lists[cls] == nullptr && !luna_refill(cache, cls))
+        return nullptr;
+
+    luna_free_block* block = cache.lists[cls];
+    cache.lists[cls] = block->next;
+    allocator->stats.class_count[cls]++;
+    return block;
+}
+
+static void luna_free_block_to(void* ptr, size_t size) {
+    if (size > LUNA_ALLOC_SMALL_MAX) {
+        free(ptr);
+        return;
+    }
+
+    int cls = luna_size_class(size);
+    luna_thread_cache& cache = t_cache;
+    auto block = (luna_free_block*)ptr;
+    block->next = cache.lists[cls];
+    cache.lists[cls] = block;
+}
+
+static void luna_heap_forget_live(luna_heap_profiler* heap, void* ptr) {
+    if (heap->live.empty())
+        return;
+
+    auto it = heap->live.find(ptr);
+    if (it != heap->live.end()) {
+        heap->stacks[it->second.first].live_bytes -= it->second.second;
+        heap->live.erase(it);
+    }
+}
+
+// 内存块被释放或者移动
+static void luna_heap_forget(luna_heap_profiler* heap, void* ptr) {
+    for (int i = 0; i < heap->pending_count; i++) {
+        if (heap->pending[i].ptr == ptr) {
+            heap->pending[i] = heap->pending[--heap->pending_count];
+            break;
+        }
+    }
+    luna_heap_forget_live(heap, ptr);
+}
+
+static void luna_heap_hook(lua_State* L, lua_Debug* hook_ar);
+
+// 每分配interval字节产生一个样本,一次大的分配可能跨过多个采样点
+static void luna_heap_alloc(luna_allocator* allocator, void* ptr, size_t size) {
+    luna_heap_profiler* heap = allocator->heap;
+    if (size < heap->countdown) {
+        heap->countdown -= size;
+        return;
+    }
+
+    size_t over = size - heap->countdown;
+    size_t weight = heap->interval * (over / heap->interval + 1);
+    heap->countdown = heap->interval - over % heap->interval;
+    if (heap->pending_count == s_heap_pending_max) {
+        allocator->stats.heap_dropped++;
+        return;
+    }
+
+    heap->pending[heap->pending_count++] = { ptr, weight };
+    // 其他保存/恢复hook的代码(例如执行预算)可能在hook触发前换回了它保存的hook,此时需要重新设置
+    if (!heap->armed || lua_gethook(heap->L) != luna_heap_hook) {
+        // 分配器中lua栈的状态不确定,在下一条指令执行时再取调用栈
+        heap->armed = true;
+        heap->old_hook = lua_gethook(heap->L);
+        heap->old_mask = lua_gethookmask(heap->L);
+        heap->old_count = lua_gethookcount(heap->L);
+        lua_sethook(heap->L, luna_heap_hook, LUA_MASKCOUNT, 1);
+    }
+}
+
+// ptr不为空时osize为原来的大小,lua保证释放和realloc时传入的osize与分配时一致
+static void* luna_alloc_func(void* ud, void* ptr, size_t osize, size_t nsize) {
+    auto allocator = (luna_allocator*)ud;
+    luna_alloc_stats& stats = allocator->stats;
+    size_t old_size = ptr ? osize : 0;
+
+    luna_heap_profiler* heap = allocator->heap;
+    if (nsize == 0) {
+        if (ptr != nullptr) {
+            if (heap != nullptr) {
+                luna_heap_forget(heap, ptr);
+            }
+            luna_free_block_to(ptr, osize);
+            stats.in_use -= osize;
+        }
+        return nullptr;
+    }
+
+    if (stats.quota > 0 && nsize > old_size && stats.in_use + nsize - old_size > stats.quota) {
+        stats.quota_refused++;
+        return nullptr;
+    }
+
+    void* block = nullptr;
+    if (ptr != nullptr && osize > LUNA_ALLOC_SMALL_MAX && nsize > LUNA_ALLOC_SMALL_MAX) {
+        block = realloc(ptr, nsize);
+        if (block == nullptr)
+            return nullptr;
+        stats.large_count++;
+    } else if (ptr != nullptr && osize <= LUNA_ALLOC_SMALL_MAX && nsize <= LUNA_ALLOC_SMALL_MAX && luna_size_class(osize) == luna_size_class(nsize)) {
+        block = ptr;
+    } else {
+        block = luna_alloc_block(allocator, nsize);
+        if (block == nullptr) {
+            // lua假定缩小内存块不会失败,此时继续使用原来的块,释放时它会归入较小的尺寸类
+            if (nsize > old_size)
+                return nullptr;
+            block = ptr;
+        } else if (ptr != nullptr) {
+            memcpy(block, ptr, std::min(osize, nsize));
+            luna_free_block_to(ptr, osize);
+        }
+    }
+
+    if (heap != nullptr) {
+        if (ptr != nullptr && block != ptr) {
+            luna_heap_forget(heap, ptr);
+        }
+        if (heap->active && nsize > old_size) {
+            luna_heap_alloc(allocator, block, nsize - old_size);
+        }
+    }
+
+    stats.in_use += nsize - old_size;
+    stats.peak = std::max(stats.peak, stats.in_use);
+    return block;
+}
+
+lua_State* luna_newstate(size_t quota) {
+    auto allocator = new luna_allocator();
+    allocator->stats.quota = quota;
+    lua_State* L = lua_newstate(luna_alloc_func, allocator);
+    if (L == nullptr) {
+        delete allocator;
+    }
+    return L;
+}
+
+static luna_allocator* luna_get_allocator(lua_State* L) {
+    void* ud = nullptr;
+    return lua_getallocf(L, &ud) == luna_alloc_func ? (luna_allocator*)ud : nullptr;
+}
+
+void luna_close(lua_State* L) {
+    luna_allocator* allocator = luna_get_allocator(L);
+    lua_close(L);
+    if (allocator != nullptr) {
+        delete allocator->heap;
+        delete allocator;
+    }
+}
+
+const luna_alloc_stats* luna_get_alloc_stats(lua_State* L) {
+    luna_allocator* allocator = luna_get_allocator(L);
+    return allocator ? &allocator->stats : nullptr;
+}
+
+void luna_set_alloc_quota(lua_State* L, size_t quota) {
+    luna_allocator* allocator = luna_get_allocator(L);
+    if (allocator != nullptr) {
+        allocator->stats.quota = quota;
+    }
+}
+
+static void luna_heap_hook(lua_State* L, lua_Debug* hook_ar) {
+    bool installed = lua_gethook(L) == luna_heap_hook;
+    luna_allocator* allocator = luna_get_allocator(L);
+    luna_heap_profiler* heap = allocator ? allocator->heap : nullptr;
+    if (heap == nullptr || !heap->armed || heap->L != L) {
+        // 被其他hook转调时不要动当前安装的hook
+        if (installed) {
+            lua_sethook(L, nullptr, 0, 0);
+        }
+        return;
+    }
+
+    // 先恢复原来的hook(例如采样profiler),hook中新产生的样本会在下一条指令记录
+    heap->armed = false;
+    lua_sethook(L, heap->old_hook, heap->old_mask, heap->old_count);
+
+    lua_Debug ar;
+    char frames[32][128];
+    int depth = 0;
+    int max_depth = std::min(heap->max_depth, 32);
+    while (depth < max_depth && lua_getstack(L, depth, &ar)) {
+        lua_getinfo(L, "Snf", &ar);
+        _lua_sample_frame(L, &ar, frames[depth], sizeof(frames[depth]));
+        lua_pop(L, 1);
+        depth++;
+    }
+
+    std::string stack = depth == max_depth && lua_getstack(L, depth, &ar) ? "[truncated]" : "";
+    while (depth > 0) {
+        if (!stack.empty()) stack += ';';
+        stack += frames[--depth];
+    }
+
+    auto it = heap->stack_index.find(stack);
+    if (it == heap->stack_index.end()) {
+        it = heap->stack_index.emplace(stack, heap->stacks.size()).first;
+        heap->stacks.emplace_back();
+        heap->stacks.back().stack = stack;
+    }
+
+    size_t index = it->second;
+    luna_heap_record& record = heap->stacks[index];
+    for (int i = 0; i < heap->pending_count; i++) {
+        luna_heap_sample& sample = heap->pending[i];
+        luna_heap_forget_live(heap, sample.ptr);
+        heap->live[sample.ptr] = { index, sample.weight };
+        record.live_bytes += sample.weight;
+        record.alloc_bytes += sample.weight;
+        record.samples++;
+    }
+    heap->pending_count = 0;
+    // 换回的可能是执行预算的hook,它的计数已被清零,频繁采样时预算可能永远不会触发
+    if (installed) {
+        _lua_budget_poll(L);
+    }
+}
+
+bool _luna_heap_replace_hook(lua_State* L, lua_Hook from, lua_Hook to, int mask, int count) {
+    luna_allocator* allocator = luna_get_allocator(L);
+    luna_heap_profiler* heap = allocator ? allocator->heap : nullptr;
+    if (heap == nullptr || !heap->armed || heap->L != L || heap->old_hook != from || lua_gethook(L) != luna_heap_hook)
+        return false;
+
+    heap->old_hook = to;
+    heap->old_mask = mask;
+    heap->old_count = count;
+    return true;
+}
+
+bool luna_heap_start(lua_State* L, size_t interval, int max_depth) {
+    luna_allocator* allocator = luna_get_allocator(L);
+    if (allocator == nullptr)
+        return false;
+
+    if (allocator->heap == nullptr) {
+        allocator->heap = new luna_heap_profiler();
+    }
+
+    luna_heap_profiler* heap = allocator->heap;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    heap->L = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    heap->interval = std::max<size_t>(interval, 1);
+    heap->countdown = heap->interval;
+    heap->max_depth = std::max(max_depth, 1);
+    heap->active = true;
+    return true;
+}
+
+void luna_heap_stop(lua_State* L) {
+    luna_allocator* allocator = luna_get_allocator(L);
+    if (allocator != nullptr && allocator->heap != nullptr) {
+        allocator->heap->active = false;
+    }
+}
+
+void luna_heap_reset(lua_State* L) {
+    luna_allocator* allocator = luna_get_allocator(L);
+    luna_heap_profiler* heap = allocator ? allocator->heap : nullptr;
+    if (heap != nullptr) {
+        heap->pending_count = 0;
+        allocator->stats.heap_dropped = 0;
+        heap->live.clear();
+        heap->stacks.clear();
+        heap->stack_index.clear();
+    }
+}
+
+void luna_heap_report(lua_State* L, std::vector<luna_heap_record>* records, size_t top_n) {
+    records->clear();
+    luna_allocator* allocator = luna_get_allocator(L);
+    if (allocator == nullptr || allocator->heap == nullptr)
+        return;
+
+    *records = allocator->heap->stacks;
+    std::sort(records->begin(), records->end(), [](auto& a, auto& b) { return a.live_bytes > b.live_bytes; });
+    if (top_n > 0 && records->size() > top_n) {
+        records->resize(top_n);
+    }
+}
+
+std::string luna_heap_folded(lua_State* L) {
+    std::vector<luna_heap_record> records;
+    luna_heap_report(L, &records);
+    std::string text;
+    for (auto& record : records) {
+        if (record.live_bytes == 0)
+            continue;
+        text += record.stack;
+        text += ' ';
+        text += std::to_string(record.live_bytes);
+        text += '\n';
+    }
+    return text;
+}
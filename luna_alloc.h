@@ -0,0 +1,56 @@
+﻿/*
+** repository: https://github.com/trumanzhao/luna
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct lua_State;
+
+// 小块内存按16字节一档分为16个尺寸类(16~256字节),从线程本地的空闲链表分配; 更大的内存直接使用malloc/realloc
+// 空闲的小块不会还给系统,线程退出时交给全局的仓库,供其他线程复用
+const int LUNA_ALLOC_CLASSES = 16;
+const size_t LUNA_ALLOC_GRANULE = 16;
+const size_t LUNA_ALLOC_SMALL_MAX = LUNA_ALLOC_CLASSES * LUNA_ALLOC_GRANULE;
+
+struct luna_alloc_stats {
+    size_t in_use = 0;          // 当前使用的字节数(lua请求的大小)
+    size_t peak = 0;
+    size_t quota = 0;           // 内存上限,0表示不限制
+    uint64_t quota_refused = 0; // 因超过上限而失败的分配次数
+    uint64_t large_count = 0;   // 大于LUNA_ALLOC_SMALL_MAX的分配次数
+    uint64_t heap_dropped = 0;  // 堆分配采样中因等待记录的样本过多而丢弃的样本数
+    uint64_t class_count[LUNA_ALLOC_CLASSES] = {}; // 各尺寸类的分配次数
+};
+
+// 使用luna分配器创建lua_State, quota为内存上限(字节),0表示不限制
+// 超过上限时分配失败,lua会先执行一次紧急gc再重试,仍然失败才抛出内存错误
+lua_State* luna_newstate(size_t quota = 0);
+// 关闭lua_State并释放分配器; 对于不是luna_newstate创建的lua_State等同于lua_close
+void luna_close(lua_State* L);
+// 不是luna_newstate创建的lua_State返回nullptr
+const luna_alloc_stats* luna_get_alloc_stats(lua_State* L);
+void luna_set_alloc_quota(lua_State* L, size_t quota);
+
+// 堆分配采样: 大约每分配interval字节采样一次,在下一条lua指令执行时(count hook中)记录主线程的lua调用栈,
+// 并把样本代表的字节数记到该调用栈上,样本对应的内存块释放时再减去,从而得到各调用栈上存活的字节数
+// 只对luna_newstate创建的lua_State有效; 协程中的分配会记到主线程恢复执行时的调用栈上
+struct luna_heap_record {
+    std::string stack;          // folded格式: 根帧;...;叶子帧
+    size_t live_bytes = 0;      // 估算的存活字节数
+    uint64_t alloc_bytes = 0;   // 估算的累计分配字节数
+    uint64_t samples = 0;
+};
+
+bool luna_heap_start(lua_State* L, size_t interval = 512 * 1024, int max_depth = 32);
+// 停止采样,已有的结果保留到luna_heap_reset
+void luna_heap_stop(lua_State* L);
+void luna_heap_reset(lua_State* L);
+// 按存活字节数从高到低排序,top_n为0时返回全部
+void luna_heap_report(lua_State* L, std::vector<luna_heap_record>* records, size_t top_n = 0);
+// 每行: "根帧;...;叶子帧 存活字节数", 可以交给flamegraph.pl生成内存火焰图
+std::string luna_heap_folded(lua_State* L);
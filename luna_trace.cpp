@@ -0,0 +1,221 @@
+﻿/*
+** repository: https://github.com/trumanzhao/luna
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "lua.hpp"
+#include "luna_trace.h"
+
+std::atomic<bool> g_luna_trace_on(false);
+
+// 单个线程的环形缓冲,只有所属线程写入事件; 写入,dump时的拷贝,清空和改变大小都要持有busy
+// 平时只有所属线程在用,busy没有竞争,只是一次原子交换
+struct luna_trace_ring {
+    std::vector<luna_trace_event> events;
+    uint64_t head = 0;
+    int tid = 0;
+    std::atomic_flag busy = ATOMIC_FLAG_INIT;
+};
+
+struct luna_ring_guard {
+    luna_trace_ring* ring;
+    explicit luna_ring_guard(luna_trace_ring* r) : ring(r) {
+        while (ring->busy.test_and_set(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+    ~luna_ring_guard() { ring->busy.clear(std::memory_order_release); }
+};
+
+static std::mutex s_ring_lock;
+// 线程退出后缓冲仍然保留,以便dump
+static std::vector<std::unique_ptr<luna_trace_ring>> s_rings;
+static std::atomic<size_t> s_ring_size(65536);
+static thread_local luna_trace_ring* t_ring = nullptr;
+
+static luna_trace_ring* luna_trace_get_ring() {
+    if (t_ring == nullptr) {
+        auto ring = std::make_unique<luna_trace_ring>();
+        ring->events.resize(std::max<size_t>(s_ring_size.load(), 1));
+        std::lock_guard<std::mutex> lock(s_ring_lock);
+        ring->tid = (int)s_rings.size() + 1;
+        t_ring = ring.get();
+        s_rings.push_back(std::move(ring));
+    }
+    return t_ring;
+}
+
+static luna_trace_event* luna_trace_alloc(luna_trace_ring* ring) {
+    return &ring->events[ring->head++ % ring->events.size()];
+}
+
+static void luna_trace_set_name(luna_trace_event* event, const char* name) {
+    size_t len = name ? strlen(name) : 0;
+    len = std::min(len, sizeof(event->name) - 1);
+    memcpy(event->name, name ? name : "", len);
+    event->name[len] = 0;
+}
+
+void luna_trace_start(size_t ring_size) {
+    ring_size = std::max<size_t>(ring_size, 1);
+    s_ring_size = ring_size;
+    std::lock_guard<std::mutex> lock(s_ring_lock);
+    for (auto& ring : s_rings) {
+        luna_ring_guard guard(ring.get());
+        if (ring->events.size() != ring_size) {
+            // 大小改变时丢弃原有的记录
+            ring->events.assign(ring_size, luna_trace_event());
+            ring->head = 0;
+        }
+    }
+    g_luna_trace_on = true;
+}
+
+void luna_trace_stop() {
+    g_luna_trace_on = false;
+}
+
+void luna_trace_clear() {
+    std::lock_guard<std::mutex> lock(s_ring_lock);
+    for (auto& ring : s_rings) {
+        luna_ring_guard guard(ring.get());
+        ring->head = 0;
+    }
+}
+
+uint64_t luna_trace_now() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void luna_trace_complete(const char* cat, const char* name, uint64_t start, const char* arg0, int64_t value0, const char* arg1, int64_t value1) {
+    uint64_t now = luna_trace_now();
+    luna_trace_ring* ring = luna_trace_get_ring();
+    luna_ring_guard guard(ring);
+    luna_trace_event* event = luna_trace_alloc(ring);
+    event->ts = start;
+    event->dur = now - start;
+    event->phase = 'X';
+    event->cat = cat;
+    event->arg_names[0] = arg0;
+    event->args[0] = value0;
+    event->arg_names[1] = arg1;
+    event->args[1] = value1;
+    luna_trace_set_name(event, name);
+}
+
+void luna_trace_instant(const char* cat, const char* name, const char* arg0, int64_t value0) {
+    luna_trace_ring* ring = luna_trace_get_ring();
+    luna_ring_guard guard(ring);
+    luna_trace_event* event = luna_trace_alloc(ring);
+    event->ts = luna_trace_now();
+    event->dur = 0;
+    event->phase = 'i';
+    event->cat = cat;
+    event->arg_names[0] = arg0;
+    event->args[0] = value0;
+    event->arg_names[1] = nullptr;
+    luna_trace_set_name(event, name);
+}
+
+static void luna_trace_new_sentinel(lua_State* L);
+
+static int luna_trace_gc_sentinel(lua_State* L) {
+    if (luna_trace_enabled()) {
+        luna_trace_instant("lua", "gc", "kb", lua_gc(L, LUA_GCCOUNT, 0));
+    }
+    // 关闭lua_State时新放置的哨兵不会再被终结
+    luna_trace_new_sentinel(L);
+    return 0;
+}
+
+static void luna_trace_new_sentinel(lua_State* L) {
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, luna_trace_gc_sentinel);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+}
+
+void luna_trace_watch_gc(lua_State* L) {
+    static const char s_watched = 0;
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &s_watched) == LUA_TNIL) {
+        luna_trace_new_sentinel(L);
+        lua_pushboolean(L, 1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &s_watched);
+    }
+    lua_pop(L, 1);
+}
+
+static void luna_trace_escape(std::string& out, const char* text) {
+    for (const char* c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            out += '\\';
+            out += *c;
+        } else if ((unsigned char)*c < 0x20) {
+            out += ' ';
+        } else {
+            out += *c;
+        }
+    }
+}
+
+std::string luna_trace_json() {
+    std::string out = "{\"traceEvents\":[";
+    char buffer[128];
+    bool first = true;
+    std::vector<luna_trace_event> events;
+    std::lock_guard<std::mutex> lock(s_ring_lock);
+    for (auto& ring : s_rings) {
+        // 先在busy保护下按时间顺序拷出快照,格式化时不阻塞写入线程
+        {
+            luna_ring_guard guard(ring.get());
+            uint64_t size = ring->events.size();
+            uint64_t first_index = ring->head > size ? ring->head - size : 0;
+            events.clear();
+            for (uint64_t i = first_index; i < ring->head; i++) {
+                events.push_back(ring->events[i % size]);
+            }
+        }
+        for (const luna_trace_event& event : events) {
+            out += first ? "\n" : ",\n";
+            first = false;
+            out += "{\"name\":\"";
+            luna_trace_escape(out, event.name);
+            snprintf(buffer, sizeof(buffer), "\",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+                event.cat ? event.cat : "luna", event.phase, ring->tid, event.ts / 1000.0);
+            out += buffer;
+            if (event.phase == 'X') {
+                snprintf(buffer, sizeof(buffer), ",\"dur\":%.3f", event.dur / 1000.0);
+                out += buffer;
+            } else {
+                out += ",\"s\":\"t\"";
+            }
+            out += ",\"args\":{";
+            for (int n = 0; n < 2 && event.arg_names[n] != nullptr; n++) {
+                snprintf(buffer, sizeof(buffer), "%s\"%s\":%lld", n > 0 ? "," : "", event.arg_names[n], (long long)event.args[n]);
+                out += buffer;
+            }
+            out += "}}";
+        }
+    }
+    out += "\n]}\n";
+    return out;
+}
+
+bool luna_trace_dump(const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (file == nullptr)
+        return false;
+    std::string json = luna_trace_json();
+    bool ok = fwrite(json.c_str(), 1, json.size(), file) == json.size();
+    fclose(file);
+    return ok;
+}
@@ -0,0 +1,46 @@
+﻿/*
+** repository: https://github.com/trumanzhao/luna
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+struct lua_State;
+
+// 时间线记录: 按线程记录C++与lua之间的调用事件,导出为chrome trace_event格式的json,可以在chrome://tracing或Perfetto中打开
+// 覆盖lua_call_function,导出函数的bridge,lua_archiver的save/load,以及lua的gc周期
+// 默认关闭,关闭时每个记录点只有一次原子变量的读取
+struct luna_trace_event {
+    uint64_t ts = 0;            // 开始时间,纳秒
+    uint64_t dur = 0;           // 持续时间,纳秒
+    char phase = 'X';           // 'X': 完整事件, 'i': 瞬时事件
+    const char* cat = nullptr;  // 分类,必须是字符串常量
+    const char* arg_names[2] = {}; // 参数名,必须是字符串常量
+    int64_t args[2] = {};
+    char name[48] = {};
+};
+
+extern std::atomic<bool> g_luna_trace_on;
+inline bool luna_trace_enabled() { return g_luna_trace_on.load(std::memory_order_relaxed); }
+
+// 每个线程第一次记录时创建自己的环形缓冲,ring_size为事件个数,写满后覆盖最旧的事件
+// 已有的缓冲大小与ring_size不同时会重新分配,其中的记录被丢弃
+void luna_trace_start(size_t ring_size = 65536);
+void luna_trace_stop();
+// 清空所有线程的记录,应在停止记录后调用
+void luna_trace_clear();
+uint64_t luna_trace_now();
+// 记录一个从start(luna_trace_now()的返回值)到现在的完整事件
+void luna_trace_complete(const char* cat, const char* name, uint64_t start,
+    const char* arg0 = nullptr, int64_t value0 = 0, const char* arg1 = nullptr, int64_t value1 = 0);
+void luna_trace_instant(const char* cat, const char* name, const char* arg0 = nullptr, int64_t value0 = 0);
+
+// 在lua_State中放置一个哨兵对象,每轮gc结束时记录一个瞬时事件(附带当前内存KB数),之后重新放置; 重复调用无副作用
+void luna_trace_watch_gc(lua_State* L);
+
+// 导出为chrome trace_event json
+std::string luna_trace_json();
+bool luna_trace_dump(const char* filename);
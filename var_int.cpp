@@ -4,8 +4,37 @@
 */
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include "var_int.h"
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define VARINT_SSE41
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define VARINT_TARGET_SSE41
+#else
+#define VARINT_TARGET_SSE41 __attribute__((target("sse4.1")))
+#endif
+#endif
+
+// 64位整数最多编码为10个字节
+static const int max_encode_len = 10;
+
+// 调用者保证data中至少有max_encode_len字节
+static inline size_t decode_u64_unchecked(uint64_t* value, const unsigned char* data) {
+    uint64_t number = 0;
+    for (int i = 0; i < max_encode_len; i++) {
+        uint64_t code = data[i] & 0x7F;
+        number |= (code << (i * 7));
+        if ((data[i] & 0x80) == 0) {
+            *value = number;
+            return (size_t)(i + 1);
+        }
+    }
+    return 0;
+}
+
 size_t encode_u64(unsigned char* buffer, size_t buffer_size, uint64_t value) {
     auto pos = buffer, end = buffer + buffer_size;
     do {
@@ -19,6 +48,9 @@ size_t encode_u64(unsigned char* buffer, size_t buffer_size, uint64_t value) {
 }
 
 size_t decode_u64(uint64_t* value, const unsigned char* data, size_t data_len) {
+    if (data_len >= max_encode_len)
+        return decode_u64_unchecked(value, data);
+
     auto pos = data, end = data + data_len;
     uint64_t code = 0, number = 0;
     int bits = 0;
@@ -72,4 +104,171 @@ size_t decode_s64(int64_t* value, const unsigned char* data, size_t data_len) {
     return count;
 }
 
+static size_t encode_batch_scalar(unsigned char* buffer, size_t buffer_size, const uint64_t* values, size_t count) {
+    auto pos = buffer, end = buffer + buffer_size;
+    for (size_t i = 0; i < count; i++) {
+        if (end - pos >= MAX_VARINT_SIZE) {
+            pos += encode_u64_unchecked(pos, values[i]);
+            continue;
+        }
+        size_t len = encode_u64(pos, (size_t)(end - pos), values[i]);
+        if (len == 0)
+            return 0;
+        pos += len;
+    }
+    return (size_t)(pos - buffer);
+}
 
+static size_t decode_batch_scalar(uint64_t* values, size_t count, const unsigned char* data, size_t data_len) {
+    auto pos = data, end = data + data_len;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = decode_u64(&values[i], pos, (size_t)(end - pos));
+        if (len == 0)
+            return 0;
+        pos += len;
+    }
+    return (size_t)(pos - data);
+}
+
+#ifdef VARINT_SSE41
+static bool has_sse41() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 19)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+static inline int lowest_bit(unsigned x) {
+#ifdef _MSC_VER
+    unsigned long idx = 0;
+    _BitScanForward(&idx, x);
+    return (int)idx;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+// 把len(1~10)个字节的编码拼成整数,没有逐字节的分支; data后面至少要有10个可读的字节
+static inline uint64_t assemble_u64(const unsigned char* data, int len) {
+    uint64_t bytes;
+    memcpy(&bytes, data, sizeof(bytes));
+    int low_len = len < 8 ? len : 8;
+    bytes &= ~0ull >> (64 - low_len * 8);
+    uint64_t number = 0;
+    for (int i = 0; i < 8; i++) {
+        number |= (bytes >> i) & (0x7Full << (i * 7));
+    }
+    if (len > 8) {
+        number |= (uint64_t)(data[8] & 0x7F) << 56;
+        if (len > 9) {
+            number |= (uint64_t)(data[9] & 0x7F) << 63;
+        }
+    }
+    return number;
+}
+
+// 每次取16个值,都小于128时(最常见的情况)用两级pack直接得到16个字节,否则逐个编码
+VARINT_TARGET_SSE41 static size_t encode_batch_sse41(unsigned char* buffer, size_t buffer_size, const uint64_t* values, size_t count) {
+    auto pos = buffer, end = buffer + buffer_size;
+    const __m128i high_bits = _mm_set1_epi64x((long long)~0x7Full);
+    size_t i = 0;
+    while (count - i >= 16 && end - pos >= 16 * MAX_VARINT_SIZE) {
+        __m128i v[8];
+        __m128i any = _mm_setzero_si128();
+        for (int k = 0; k < 8; k++) {
+            v[k] = _mm_loadu_si128((const __m128i*)(values + i + k * 2));
+            any = _mm_or_si128(any, v[k]);
+        }
+        if (_mm_testz_si128(any, high_bits)) {
+            // 每个值只有低7位,高32位为0,按32位lane两次packus得到16位的值,最后packus到字节
+            __m128i a = _mm_packus_epi32(_mm_packus_epi32(v[0], v[1]), _mm_packus_epi32(v[2], v[3]));
+            __m128i b = _mm_packus_epi32(_mm_packus_epi32(v[4], v[5]), _mm_packus_epi32(v[6], v[7]));
+            _mm_storeu_si128((__m128i*)pos, _mm_packus_epi16(a, b));
+            pos += 16;
+        } else {
+            for (int k = 0; k < 16; k++) {
+                pos += encode_u64_unchecked(pos, values[i + k]);
+            }
+        }
+        i += 16;
+    }
+    size_t len = encode_batch_scalar(pos, (size_t)(end - pos), values + i, count - i);
+    if (len == 0 && i < count)
+        return 0;
+    return (size_t)(pos - buffer) + len;
+}
+
+// 每次取16个字节,用movemask得到各字节的延续位,由此直接算出块内每个值的长度;
+// 16个字节都是单字节编码时直接零扩展成16个整数; 跨块的值留到下一轮
+// assemble_u64会越过块尾最多读10个字节,所以只在剩余至少32字节时走这里,最后一段逐个解码
+VARINT_TARGET_SSE41 static size_t decode_batch_sse41(uint64_t* values, size_t count, const unsigned char* data, size_t data_len) {
+    auto pos = data, end = data + data_len;
+    size_t i = 0;
+    while (i < count && end - pos >= 32) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)pos);
+        unsigned ends = ~(unsigned)_mm_movemask_epi8(chunk) & 0xFFFF;
+        if (ends == 0xFFFF && count - i >= 16) {
+            for (int k = 0; k < 8; k++) {
+                _mm_storeu_si128((__m128i*)(values + i + k * 2), _mm_cvtepu8_epi64(chunk));
+                chunk = _mm_srli_si128(chunk, 2);
+            }
+            pos += 16;
+            i += 16;
+            continue;
+        }
+
+        // 16个字节中没有结尾,编码超过了10字节
+        if (ends == 0)
+            return 0;
+
+        int offset = 0;
+        while (ends != 0 && i < count) {
+            int last = lowest_bit(ends);
+            int len = last + 1 - offset;
+            if (len > max_encode_len)
+                return 0;
+            values[i++] = assemble_u64(pos + offset, len);
+            offset = last + 1;
+            ends &= ends - 1;
+        }
+        pos += offset;
+    }
+    size_t len = decode_batch_scalar(values + i, count - i, pos, (size_t)(end - pos));
+    if (len == 0 && i < count)
+        return 0;
+    return (size_t)(pos - data) + len;
+}
+#endif
+
+typedef size_t (*encode_batch_func)(unsigned char*, size_t, const uint64_t*, size_t);
+typedef size_t (*decode_batch_func)(uint64_t*, size_t, const unsigned char*, size_t);
+
+// 运行时按CPU支持的指令集选择实现
+static encode_batch_func select_encode_batch() {
+#ifdef VARINT_SSE41
+    if (has_sse41())
+        return encode_batch_sse41;
+#endif
+    return encode_batch_scalar;
+}
+
+static decode_batch_func select_decode_batch() {
+#ifdef VARINT_SSE41
+    if (has_sse41())
+        return decode_batch_sse41;
+#endif
+    return decode_batch_scalar;
+}
+
+size_t encode_u64_batch(unsigned char* buffer, size_t buffer_size, const uint64_t* values, size_t count) {
+    static const encode_batch_func func = select_encode_batch();
+    return func(buffer, buffer_size, values, count);
+}
+
+size_t decode_u64_batch(uint64_t* values, size_t count, const unsigned char* data, size_t data_len) {
+    static const decode_batch_func func = select_decode_batch();
+    return func(values, count, data, data_len);
+}
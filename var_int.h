@@ -14,6 +14,25 @@ size_t encode_u64(unsigned char* buffer, size_t buffer_size, uint64_t value);
 // 返回值: 成功,返回解码长度; 失败,返回0;
 size_t decode_u64(uint64_t* value, const unsigned char* data, size_t data_len);
 
+// 调用者已经保证buffer中至少有MAX_VARINT_SIZE字节时使用,省去逐字节的边界检查
+// 返回值: 编码长度
+inline size_t encode_u64_unchecked(unsigned char* buffer, uint64_t value) {
+    auto pos = buffer;
+    while (value >= 0x80) {
+        *pos++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *pos++ = (unsigned char)value;
+    return (size_t)(pos - buffer);
+}
+
+// 批量编码count个无符号整数,结果与逐个调用encode_u64相同
+// 返回值: 成功,返回编码总长度; buffer不够时返回0;
+size_t encode_u64_batch(unsigned char* buffer, size_t buffer_size, const uint64_t* values, size_t count);
+// 批量解码count个无符号整数,结果与逐个调用decode_u64相同
+// 返回值: 成功,返回解码总长度; 数据不足或者格式错误时返回0(count为0时也返回0);
+size_t decode_u64_batch(uint64_t* values, size_t count, const unsigned char* data, size_t data_len);
+
 // 将有符号整数编码到字节数组
 // 返回值: 成功,返回编码长度; 失败,返回0;
 size_t encode_s64(unsigned char* buffer, size_t buffer_size, int64_t value);